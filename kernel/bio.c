@@ -1,12 +1,16 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
+// * To start reading a block that will be wanted soon, call breadahead.
+// * breadv_async and bwritev_async start I/O on many buffers
+//     at once without waiting for it; bwait finishes it.
+// * iosched.c decides when blocks go to the disk.
 // * After changing buffer data, call bwrite to write it to disk.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
@@ -22,70 +26,411 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "stat.h"
+
+// The cache starts with NBUF buffers, and grows by allocating
+// more from a slab cache, up to NBUFMAX, as long as more than
+// BUFMINFREE pages of memory are free; otherwise it recycles
+// buffers. When memory runs low, bshrink() frees unused
+// buffers beyond the first NBUF.
+//
+// Recycling follows the 2Q policy, so that a stream of blocks
+// each read once (a big file, say) doesn't push out the blocks
+// that are used over and over (superblock, bitmap, inodes). A
+// block read into the cache joins the A1in queue, which is
+// FIFO. If it is recycled from A1in and then wanted again
+// while it is still remembered on the A1out ghost list, it
+// joins the Am queue, which is LRU, instead. bvictim() recycles
+// from A1in while A1in holds more than a quarter of the cache,
+// and otherwise from Am.
+//
+// Each queue is a list, newest first: a buffer joins the front
+// of A1in when it is filled, and moves to the front of Am each
+// time it is released, so bvictim() takes the unused buffer
+// nearest the back. A1out is a ring of block numbers, also
+// hashed so that bghost() needn't search it.
+//
+// buffers are hashed by (dev, blockno) into buckets, each
+// with its own lock, so that lookups of different blocks
+// don't contend. bcache.lock serializes only the recycling of
+// an unused buffer, which moves it between buckets; whoever
+// holds it may hold two bucket locks at once. bcache.qlock
+// protects the queue lists, and comes after the others.
+#define NBUCKET 13
+#define NGHOST  (NBUFMAX/2)  // size of the A1out ghost list
+#define NGHASH  256          // hash chains of the ghost list
+
+// buf queue values
+#define A1IN 0
+#define AM   1
+
+// A1out entry: a block recently recycled from A1in.
+struct ghost {
+  uint dev;
+  uint blockno;
+  int used;                  // on a hash chain?
+  struct ghost *hprev;       // hash chain
+  struct ghost *hnext;
+};
 
 struct {
   struct spinlock lock;
   struct buf buf[NBUF];
+  struct kmem_cache *cache;  // for buffers beyond the first NBUF
+  int n;                     // number of buffers
+
+  // the 2Q queues: circular lists through lprev/lnext.
+  struct spinlock qlock;
+  struct buf a1in;
+  struct buf am;
+  int nin;                   // number of buffers on A1in
+
+  // A1out: a ring of the last n/2 blocks recycled from A1in.
+  struct ghost ghost[NGHOST];
+  int ghead;                 // next slot to fill
+  struct ghost *ghash[NGHASH];
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // statistics, for bstat().
+  uint64 hits;
+  uint64 misses;
+  uint64 ghosthits;
+  uint64 evictions;
+
+  // hash buckets: circular lists through prev/next.
+  struct {
+    struct spinlock lock;
+    struct buf head;
+  } bucket[NBUCKET];
 } bcache;
 
+static int
+bhash(uint dev, uint blockno)
+{
+  return (dev * 31 + blockno) % NBUCKET;
+}
+
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+static void
+blink(struct buf *head, struct buf *b)
+{
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
+}
+
+// Put b at the front of queue q.
+// Caller must hold bcache.qlock.
+static void
+qpush(int q, struct buf *b)
+{
+  struct buf *head = q == A1IN ? &bcache.a1in : &bcache.am;
+
+  b->queue = q;
+  b->lnext = head->lnext;
+  b->lprev = head;
+  head->lnext->lprev = b;
+  head->lnext = b;
+  if(q == A1IN)
+    bcache.nin++;
+}
+
+// Take b off its queue.
+// Caller must hold bcache.qlock.
+static void
+qremove(struct buf *b)
+{
+  b->lnext->lprev = b->lprev;
+  b->lprev->lnext = b->lnext;
+  if(b->queue == A1IN)
+    bcache.nin--;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  int i;
 
   initlock(&bcache.lock, "bcache");
+  initlock(&bcache.qlock, "bcache.queue");
+  bcache.a1in.lprev = bcache.a1in.lnext = &bcache.a1in;
+  bcache.am.lprev = bcache.am.lnext = &bcache.am;
+  for(i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].head.prev = &bcache.bucket[i].head;
+    bcache.bucket[i].head.next = &bcache.bucket[i].head;
+  }
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // all buffers start out in bucket 0, as block 0 of device 0.
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    qpush(A1IN, b);
+    blink(&bcache.bucket[0].head, b);
   }
+  bcache.n = NBUF;
+  bcache.cache = kmem_cache_create("buf", sizeof(struct buf));
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// was b allocated by bget(), rather than one of the first NBUF?
+#define BDYNAMIC(b) ((b) < bcache.buf || (b) >= bcache.buf + NBUF)
+
+// Look for block blockno of dev in bucket i, and if found
+// take a reference to it. Caller must hold the bucket's lock.
 static struct buf*
-bget(uint dev, uint blockno)
+bfind(int i, uint dev, uint blockno)
 {
-  struct buf *b;
+  struct buf *b, *head;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  head = &bcache.bucket[i].head;
+  for(b = head->next; b != head; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
       return b;
     }
   }
+  return 0;
+}
+
+// Allocate a new buffer if the cache may grow, or return 0.
+// If force is set, grow even if memory is short.
+// Caller must hold bcache.lock.
+static struct buf*
+bgrow(int force)
+{
+  struct buf *b;
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+  if(bcache.n >= NBUFMAX || (!force && kfreemem() <= BUFMINFREE))
+    return 0;
+  if((b = kmem_cache_alloc(bcache.cache)) == 0)
+    return 0;
+  initsleeplock(&b->lock, "buffer");
+  bcache.n++;
+  return b;
+}
+
+static int
+ghash(uint dev, uint blockno)
+{
+  return (dev * 31 + blockno) % NGHASH;
+}
+
+// Take g off its hash chain.
+// Caller must hold bcache.lock.
+static void
+gunlink(struct ghost *g)
+{
+  if(g->hprev)
+    g->hprev->hnext = g->hnext;
+  else
+    bcache.ghash[ghash(g->dev, g->blockno)] = g->hnext;
+  if(g->hnext)
+    g->hnext->hprev = g->hprev;
+  g->used = 0;
+}
+
+// Remember block blockno of dev on the A1out ghost list,
+// forgetting the oldest entry. Caller must hold bcache.lock.
+static void
+gpush(uint dev, uint blockno)
+{
+  struct ghost *g = &bcache.ghost[bcache.ghead];
+  int h = ghash(dev, blockno);
+
+  if(g->used)
+    gunlink(g);
+  g->dev = dev;
+  g->blockno = blockno;
+  g->used = 1;
+  g->hprev = 0;
+  g->hnext = bcache.ghash[h];
+  if(g->hnext)
+    g->hnext->hprev = g;
+  bcache.ghash[h] = g;
+  bcache.ghead = (bcache.ghead + 1) % NGHOST;
+}
+
+// Is block blockno of dev among the last n/2 entries of the
+// A1out ghost list? If so, forget it there. Caller must hold
+// bcache.lock.
+static int
+bghost(uint dev, uint blockno)
+{
+  struct ghost *g;
+  int n, age;
+
+  n = bcache.n / 2;
+  if(n > NGHOST)
+    n = NGHOST;
+  for(g = bcache.ghash[ghash(dev, blockno)]; g; g = g->hnext){
+    if(g->dev == dev && g->blockno == blockno){
+      age = (bcache.ghead - (g - bcache.ghost) + NGHOST - 1) % NGHOST + 1;
+      if(age > n)
+        return 0;
+      gunlink(g);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Return the unused buffer nearest the back of queue q, or 0.
+// Caller must hold bcache.qlock; refcnt may change until the
+// caller takes the buffer's bucket lock.
+static struct buf*
+qoldest(int q)
+{
+  struct buf *head = q == A1IN ? &bcache.a1in : &bcache.am;
+  struct buf *b;
+
+  for(b = head->lprev; b != head; b = b->lprev)
+    if(b->refcnt == 0)
       return b;
+  return 0;
+}
+
+// Choose an unused buffer to recycle, remove it from its
+// bucket and queue and return it, or return 0 if all are in
+// use. Caller must hold bcache.lock.
+static struct buf*
+bvictim(void)
+{
+  struct buf *victim;
+  int h;
+
+  for(;;){
+    acquire(&bcache.qlock);
+    victim = 0;
+    if(bcache.nin > bcache.n / 4)
+      victim = qoldest(A1IN);
+    if(victim == 0)
+      victim = qoldest(AM);
+    if(victim == 0)
+      victim = qoldest(A1IN);
+    release(&bcache.qlock);
+    if(victim == 0)
+      return 0;
+
+    // only holders of bcache.lock move buffers between
+    // buckets, but bfind() may have taken a reference to
+    // the victim since we looked.
+    h = bhash(victim->dev, victim->blockno);
+    acquire(&bcache.bucket[h].lock);
+    if(victim->refcnt == 0){
+      bunlink(victim);
+      acquire(&bcache.qlock);
+      qremove(victim);
+      release(&bcache.qlock);
+      release(&bcache.bucket[h].lock);
+      break;
     }
+    release(&bcache.bucket[h].lock);
   }
-  panic("bget: no buffers");
+
+  if(victim->queue == A1IN && victim->valid)
+    gpush(victim->dev, victim->blockno);
+  bcache.evictions++;
+  return victim;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+// If ahead is set, return 0 for a block that is already
+// cached rather than waiting for its buffer.
+static struct buf*
+bget(uint dev, uint blockno, int ahead)
+{
+  struct buf *b, *victim;
+  int h;
+
+  h = bhash(dev, blockno);
+  acquire(&bcache.bucket[h].lock);
+  b = bfind(h, dev, blockno);
+  if(b && ahead)
+    b->refcnt--;
+  release(&bcache.bucket[h].lock);
+  if(b){
+    if(ahead)
+      return 0;
+    __sync_fetch_and_add(&bcache.hits, 1);
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Not cached. Only one process at a time adds buffers to
+  // buckets, so once we hold bcache.lock no one else can add
+  // this block; check again in case someone did before we got it.
+  acquire(&bcache.lock);
+  acquire(&bcache.bucket[h].lock);
+  b = bfind(h, dev, blockno);
+  if(b && ahead)
+    b->refcnt--;
+  release(&bcache.bucket[h].lock);
+  if(b){
+    release(&bcache.lock);
+    if(ahead)
+      return 0;
+    __sync_fetch_and_add(&bcache.hits, 1);
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // callers such as the log may hold many buffers at once, so
+  // rather than fail, grow past BUFMINFREE if all are in use.
+  if((victim = bgrow(0)) == 0 && (victim = bvictim()) == 0 &&
+     (victim = bgrow(1)) == 0)
+    panic("bget: no buffers");
+
+  if(!ahead)
+    bcache.misses++;
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->valid = 0;
+  victim->refcnt = 1;
+  acquire(&bcache.qlock);
+  if(bghost(dev, blockno)){
+    // recycled from A1in, but wanted again soon.
+    qpush(AM, victim);
+    bcache.ghosthits++;
+  } else {
+    qpush(A1IN, victim);
+  }
+  release(&bcache.qlock);
+  acquire(&bcache.bucket[h].lock);
+  blink(&bcache.bucket[h].head, victim);
+  release(&bcache.bucket[h].lock);
+  release(&bcache.lock);
+
+  acquiresleep(&victim->lock);
+  return victim;
+}
+
+// Drop a reference to an unlocked buffer.
+// If no one else is using it and it is on Am, move it to the
+// front, as the most recently used.
+static void
+bput(struct buf *b)
+{
+  int h;
+
+  h = bhash(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
+  b->refcnt--;
+  if (b->refcnt == 0 && b->queue == AM) {
+    // no one is waiting for it.
+    acquire(&bcache.qlock);
+    qremove(b);
+    qpush(AM, b);
+    release(&bcache.qlock);
+  }
+  release(&bcache.bucket[h].lock);
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,25 +439,119 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    b->done = 0;
+    iosched_submit(&b, 1, 0);
+    iosched_wait(b, 1);
     b->valid = 1;
   }
   return b;
 }
 
+// Return locked bufs in bs for the n blocks starting at
+// blockno, starting to read those that aren't cached, all
+// queued for the disk together so that they can be merged,
+// but without waiting. Call bwait() on each of bs[0..n-1]
+// before using its data.
+void
+breadv_async(uint dev, uint blockno, int n, struct buf **bs)
+{
+  struct buf *rd[MAXIOBLOCKS];
+  int i, m;
+
+  while(n > 0){
+    m = 0;
+    for(i = 0; i < n && i < MAXIOBLOCKS; i++){
+      bs[i] = bget(dev, blockno+i, 0);
+      bs[i]->done = 0;
+      if(!bs[i]->valid)
+        rd[m++] = bs[i];
+    }
+    iosched_submit(rd, m, 0);
+    bs += i;
+    blockno += i;
+    n -= i;
+  }
+}
+
+// Completion function for breadahead(): nobody is waiting
+// for the buffer, so give it back to the cache.
+static void
+bunlock(struct buf *b)
+{
+  releasesleep(&b->lock);
+  bput(b);
+}
+
+// Start reading the n blocks starting at blockno into the
+// cache, skipping any that are there already, without waiting.
+// A later bread() of one of them waits for its read to finish.
+void
+breadahead(uint dev, uint blockno, int n)
+{
+  struct buf *bs[MAXIOBLOCKS];
+  int m;
+
+  while(n > 0){
+    // gather a run of blocks that aren't cached.
+    for(m = 0; m < n && m < MAXIOBLOCKS; m++){
+      // a new buf: no one else holds it, and it isn't valid.
+      if((bs[m] = bget(dev, blockno+m, 1)) == 0)
+        break;
+      bs[m]->done = bunlock;
+    }
+    if(m == 0){
+      // cached already.
+      blockno++;
+      n--;
+      continue;
+    }
+    iosched_submit(bs, m, 0);
+    blockno += m;
+    n -= m;
+  }
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  b->done = 0;
+  iosched_submit(&b, 1, 1);
+  iosched_wait(b, 1);
+}
+
+// Start writing the n locked buffers in bs, without waiting,
+// all queued for the disk together so that they can be merged.
+// Call bwait() on each before changing or releasing it.
+void
+bwritev_async(struct buf **bs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwritev_async");
+    bs[i]->done = 0;
+  }
+  iosched_submit(bs, n, 1);
+}
+
+// Wait for I/O started by breadv_async() or bwritev_async()
+// to finish.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  iosched_wait(b, 0);
+  b->valid = 1;
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +559,83 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bput(b);
+}
 
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+// Called by the disk interrupt handler when I/O on b that has
+// a completion function finishes. The completion function runs
+// with interrupts off, so it must not sleep.
+void
+bdone(struct buf *b)
+{
+  void (*done)(struct buf*) = b->done;
+
+  b->valid = 1;
+  b->done = 0;
+  done(b);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int h = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int h = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 
+// Free up to n unused buffers beyond the first NBUF, to give
+// memory back when it runs low. Returns the number freed.
+int
+bshrink(int n)
+{
+  struct buf *b, *next, *head;
+  int i, freed;
+
+  freed = 0;
+  acquire(&bcache.lock);
+  for(i = 0; i < NBUCKET && freed < n; i++){
+    acquire(&bcache.bucket[i].lock);
+    head = &bcache.bucket[i].head;
+    for(b = head->next; b != head && freed < n; b = next){
+      next = b->next;
+      if(b->refcnt == 0 && BDYNAMIC(b)){
+        bunlink(b);
+        acquire(&bcache.qlock);
+        qremove(b);
+        release(&bcache.qlock);
+        kmem_cache_free(bcache.cache, b);
+        bcache.n--;
+        freed++;
+      }
+    }
+    release(&bcache.bucket[i].lock);
+  }
+  release(&bcache.lock);
+  return freed;
+}
 
+// Report buffer cache statistics.
+void
+bstat(struct bstat *st)
+{
+  acquire(&bcache.lock);
+  st->hits = bcache.hits;
+  st->misses = bcache.misses;
+  st->ghosthits = bcache.ghosthits;
+  st->evictions = bcache.evictions;
+  st->nbuf = bcache.n;
+  acquire(&bcache.qlock);
+  st->nin = bcache.nin;
+  release(&bcache.qlock);
+  release(&bcache.lock);
+}
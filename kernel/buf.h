@@ -1,11 +1,18 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  void (*done)(struct buf*); // called when async I/O finishes
+  int write;   // iosched: write (vs read) b->data?
+  uint64 qtime; // iosched: time CSR when queued
+  struct buf *qnext; // iosched: queue of waiting bufs
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  int queue;    // 2Q queue: A1IN or AM
+  struct buf *lprev; // queue list, newest first
+  struct buf *lnext;
+  struct buf *prev; // hash bucket list
   struct buf *next;
   uchar data[BSIZE];
 };
@@ -1,9 +1,15 @@
+struct bstat;
 struct buf;
 struct context;
+struct diskstat;
 struct file;
 struct inode;
+struct kmem_cache;
+struct kmemstat;
+struct logstat;
 struct pipe;
 struct proc;
+struct seg;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -12,10 +18,17 @@ struct superblock;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+void            breadv_async(uint, uint, int, struct buf**);
+void            breadahead(uint, uint, int);
+void            bwritev_async(struct buf**, int);
+void            bwait(struct buf*);
+void            bdone(struct buf*);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(int);
+void            bstat(struct bstat*);
 
 // console.c
 void            consoleinit(void);
@@ -24,6 +37,10 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+void            execinit(void);
+int             execfault(struct seg*, uint64);
+void            textinval(struct inode*);
+int             textreclaim(int);
 
 // file.c
 struct file*    filealloc(void);
@@ -59,18 +76,44 @@ void            ramdiskinit(void);
 void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
+// iosched.c
+void            ioschedinit(void);
+void            iosched_submit(struct buf**, int, int);
+void            iosched_run(void);
+void            iosched_done(struct buf**, int, int);
+void            iosched_wait(struct buf*, int);
+int             iosched_poll(int);
+void            diskstat(struct diskstat*);
+
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void*           kalloc_order(int);
+void*           kalloc_order_try(int);
+void*           kalloc_zeroed(void);
+int             kreclaim(int);
+int             kzero_refill(void);
+void            krefinc(void *);
+int             krefcnt(void *);
+int             kfreemem(void);
+void            kmemstat(struct kmemstat*);
+void            kfree_order(void *, int);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
+void            begin_opn(int);
 void            end_op(void);
+void            end_opn(int);
+int             log_maxop(void);
+void            log_sync(void);
+void            logtick(void);
+void            logstat(struct logstat*);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -86,6 +129,7 @@ int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
+void            kthread_create(char*, void (*)(void));
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -116,6 +160,12 @@ void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -139,6 +189,13 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// sysfile.c
+int             mmapfault(uint64, int);
+uint64          mmapbase(struct proc*);
+void            mmapsync(struct proc*);
+int             mmapfork(struct proc*, struct proc*);
+void            munmapall(struct proc*);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
@@ -162,11 +219,16 @@ pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
+void            vmcount(pagetable_t, int*, int*);
+void            vminval(void);
+int             vmfault(pagetable_t, uint64, int);
+void            uvmprefault(uint64, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
@@ -179,7 +241,9 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_submit(struct buf **, int, int);
+int             virtio_disk_poll(void);
+void            virtio_disk_intrs(int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
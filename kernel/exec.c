@@ -3,21 +3,51 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
+#include "fs.h"
+#include "file.h"
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
+// exec() maps none of the program file; execfault() reads
+// each page of it from the inode when the program first
+// touches it. Whole pages of file data are kept in a small
+// cache shared by all processes running the same program,
+// and mapped copy-on-write, so that most of a program's text
+// is read from disk once no matter how many processes run it.
+// The cache is keyed by in-memory inode, and an inode's pages
+// are dropped when it is written, truncated, or freed, or,
+// if no process has them mapped, when memory runs out.
+
+#define NTEXT 64  // pages in the shared text cache
+
+struct {
+  struct spinlock lock;
+  struct {
+    struct inode *ip;
+    uint off;
+    char *pa;   // holds one reference; 0 if slot is free
+  } page[NTEXT];
+  int hand;     // next slot to evict
+} text;
+
+void
+execinit(void)
+{
+  initlock(&text.lock, "text");
+}
 
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *exe = 0, *oldexe;
   struct proghdr ph;
+  struct seg seg[NSEG];
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
@@ -38,7 +68,10 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program's segments; execfault() will load
+  // their pages on demand. Memory past a segment's file data
+  // is zero-filled like the heap.
+  nseg = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -48,17 +81,24 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
-      goto bad;
-    sz = sz1;
     if((ph.vaddr % PGSIZE) != 0)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.vaddr < sz || ph.vaddr + ph.memsz > TRAPFRAME)
       goto bad;
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
+      goto bad;
+    if(nseg >= NSEG)
+      goto bad;
+    seg[nseg].va = ph.vaddr;
+    seg[nseg].filesz = ph.filesz;
+    seg[nseg].off = ph.off;
+    nseg++;
+    sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  // keep a reference to the program file for execfault().
+  iunlock(ip);
   end_op();
+  exe = ip;
   ip = 0;
 
   p = myproc();
@@ -109,12 +149,22 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  munmapall(p);
   oldpagetable = p->pagetable;
+  oldexe = p->exe;
   p->pagetable = pagetable;
   p->sz = sz;
+  p->exe = exe;
+  memmove(p->seg, seg, sizeof(seg));
+  p->nseg = nseg;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldexe){
+    begin_op();
+    iput(oldexe);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -125,30 +175,165 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(exe){
+    begin_op();
+    iput(exe);
+    end_op();
+  }
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
+// Read n bytes at offset off of ip into a new zeroed page.
+// Caller must hold ip->lock.
+static char*
+readpage(struct inode *ip, uint off, uint n)
+{
+  char *mem;
+
+  if((mem = kalloc_zeroed()) == 0)
+    return 0;
+  if(readi(ip, 0, (uint64)mem, off, n) != n){
+    kfree(mem);
+    return 0;
+  }
+  return mem;
+}
+
+// Return the page of ip at offset off from the text cache,
+// reading it in on a miss, with a reference for the caller.
+// Caller must hold ip->lock, so no other process can be
+// adding the same page.
+static char*
+textget(struct inode *ip, uint off)
+{
+  int i, victim;
+  char *mem, *old;
+
+  acquire(&text.lock);
+  for(i = 0; i < NTEXT; i++){
+    if(text.page[i].pa && text.page[i].ip == ip && text.page[i].off == off){
+      mem = text.page[i].pa;
+      krefinc(mem);
+      release(&text.lock);
+      return mem;
+    }
+  }
+  release(&text.lock);
+
+  if((mem = readpage(ip, off, PGSIZE)) == 0)
+    return 0;
+
+  // prefer a free slot, then a page no process has mapped.
+  acquire(&text.lock);
+  victim = -1;
+  for(i = 0; i < NTEXT; i++){
+    if(text.page[i].pa == 0){
+      victim = i;
+      break;
+    }
+    if(victim < 0 && krefcnt(text.page[i].pa) == 1)
+      victim = i;
+  }
+  if(victim < 0){
+    victim = text.hand;
+    text.hand = (text.hand + 1) % NTEXT;
+  }
+  old = text.page[victim].pa;
+  text.page[victim].ip = ip;
+  text.page[victim].off = off;
+  text.page[victim].pa = mem;
+  krefinc(mem);
+  ip->text = 1;
+  release(&text.lock);
+
+  if(old)
+    kfree(old);
+  return mem;
+}
+
+// Drop ip's pages from the text cache, since its contents
+// are about to change or the in-memory inode is going away.
+// Processes that have the pages mapped keep their copies.
+// Caller must hold ip->lock, or the last reference to ip.
+void
+textinval(struct inode *ip)
+{
+  int i;
+
+  if(ip->text == 0)
+    return;
+  acquire(&text.lock);
+  for(i = 0; i < NTEXT; i++){
+    if(text.page[i].pa && text.page[i].ip == ip){
+      kfree(text.page[i].pa);
+      text.page[i].pa = 0;
+      text.page[i].ip = 0;
+    }
+  }
+  ip->text = 0;
+  release(&text.lock);
+}
+
+// Free up to n cached pages that no process has mapped, to
+// give memory back when it runs out. Returns the number freed.
+int
+textreclaim(int n)
+{
+  int i, freed;
+
+  freed = 0;
+  acquire(&text.lock);
+  for(i = 0; i < NTEXT && freed < n; i++){
+    if(text.page[i].pa && krefcnt(text.page[i].pa) == 1){
+      kfree(text.page[i].pa);
+      text.page[i].pa = 0;
+      text.page[i].ip = 0;
+      freed++;
+    }
+  }
+  release(&text.lock);
+  return freed;
+}
+
+// Load the page containing va of the current process's
+// segment s from the program file. A page wholly backed
+// by the file is shared through the text cache, mapped
+// copy-on-write; the last, partial page is private.
 // Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+int
+execfault(struct seg *s, uint64 va)
 {
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
+  struct proc *p = myproc();
+  struct inode *ip = p->exe;
+  uint64 n;
+  uint off;
+  int locked, perm;
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  off = s->off + (va - s->va);
+  n = s->va + s->filesz - va;
+  if(n > PGSIZE)
+    n = PGSIZE;
+
+  // the fault may come from copyout() during a read()
+  // of the program file itself, which holds ip->lock.
+  locked = holdingsleep(&ip->lock);
+  if(!locked)
+    ilock(ip);
+  perm = PTE_R|PTE_X|PTE_U|PTE_COW;
+  if(n < PGSIZE || (mem = textget(ip, off)) == 0){
+    perm = PTE_W|PTE_X|PTE_R|PTE_U;
+    mem = readpage(ip, off, n);
+  }
+  if(!locked)
+    iunlock(ip);
+  if(mem == 0)
+    return -1;
+
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
   }
-  
   return 0;
 }
@@ -18,15 +18,20 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // itable list
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  int text;           // may have pages in exec's text cache
+  uint raoff;         // where a sequential reader would read next
+  uint raend;         // first block not yet read ahead
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint xblock;
+  struct extent ext[NEXTENT];
 };
 
 // map major device number to device functions.
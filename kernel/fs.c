@@ -60,28 +60,45 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Allocate a zeroed disk block: goal, if it is free, or else
+// the first free block after it (wrapping around), so that
+// blocks allocated one after another tend to be contiguous.
+// If exact is set, allocate only goal, and return 0 if it is
+// in use.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint goal, int exact)
 {
-  int b, bi, m;
+  uint b, n;
+  int bi, m;
   struct buf *bp;
 
+  if(goal >= sb.size){
+    if(exact)
+      return 0;
+    goal = 0;
+  }
   bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
+  for(n = 0; n < (exact ? 1 : sb.size); n++){
+    b = (goal + n) % sb.size;
+    if(bp == 0 || bp->blockno != BBLOCK(b, sb)){
+      if(bp)
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+      bp = bread(dev, BBLOCK(b, sb));
+    }
+    bi = b % BPB;
+    m = 1 << (bi % 8);
+    if((bp->data[bi/8] & m) == 0){  // Is block free?
+      bp->data[bi/8] |= m;  // Mark block in use.
+      log_write(bp);
+      brelse(bp);
+      bzero(dev, b);
+      return b;
     }
-    brelse(bp);
   }
+  if(bp)
+    brelse(bp);
+  if(exact)
+    return 0;
   panic("balloc: out of blocks");
 }
 
@@ -118,6 +135,8 @@ bfree(int dev, uint b)
 // to inodes used by multiple processes. The in-memory
 // inodes include book-keeping information that is
 // not stored on disk: ip->ref and ip->valid.
+// The table is a list of inodes allocated from an object
+// cache, so it grows and shrinks with the number in use.
 //
 // An inode and its in-memory representation go through a
 // sequence of states before they can be used by the
@@ -127,12 +146,11 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to a table entry (open files and
+//   current directories). iget() finds or creates a table
+//   entry and increments its ref; iput() decrements ref,
+//   and frees the entry when ref falls to zero.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
@@ -163,9 +181,10 @@ bfree(int dev, uint b)
 // multi-step atomic operations.
 //
 // The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// entries and the list that links them. Since ip->ref indicates
+// whether an entry is free, and ip->dev and ip->inum indicate
+// which i-node an entry holds, one must hold itable.lock while
+// using any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
@@ -173,18 +192,16 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache *cache;
+  struct inode *list;  // in-use inodes, linked through ip->next
 } itable;
 
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  itable.cache = kmem_cache_create("inode", sizeof(struct inode));
+  itable.list = 0;
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -231,7 +248,8 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  dip->xblock = ip->xblock;
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
   log_write(bp);
   brelse(bp);
 }
@@ -242,31 +260,33 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = itable.list; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
       ip->ref++;
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  // Allocate a new entry.
+  if((ip = kmem_cache_alloc(itable.cache)) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
+  initsleeplock(&ip->lock, "inode");
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->text = 0;
+  ip->raoff = 0;
+  ip->raend = 0;
+  ip->next = itable.list;
+  itable.list = ip;
   release(&itable.lock);
 
   return ip;
@@ -304,7 +324,8 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    ip->xblock = dip->xblock;
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -323,8 +344,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry is
+// freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -354,6 +375,16 @@ iput(struct inode *ip)
   }
 
   ip->ref--;
+  if(ip->ref == 0){
+    struct inode **pp;
+    for(pp = &itable.list; *pp != ip; pp = &(*pp)->next)
+      ;
+    *pp = ip->next;
+    release(&itable.lock);
+    textinval(ip);
+    kmem_cache_free(itable.cache, ip);
+    return;
+  }
   release(&itable.lock);
 }
 
@@ -368,40 +399,79 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in runs of consecutive blocks on the disk, called extents.
+// The first NEXTENT extents are listed in ip->ext[], the next
+// NXEXTENT in block ip->xblock. A file's extents cover its
+// blocks in order, so most files, allocated a block at a time
+// next to the last, need just one or two, and mapping a block
+// seldom reads anything but the inode.
+
+// Return a pointer to extent i of inode ip, or 0 if ip has no
+// extent block to hold it. *bpp holds the extent block, if it
+// has been read.
+static struct extent*
+extent(struct inode *ip, int i, struct buf **bpp)
+{
+  if(i < NEXTENT)
+    return &ip->ext[i];
+  if(ip->xblock == 0)
+    return 0;
+  if(*bpp == 0)
+    *bpp = bread(ip->dev, ip->xblock);
+  return (struct extent*)(*bpp)->data + (i - NEXTENT);
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one, extending the
+// last extent if the block after it is free. Returns 0 if ip
+// is out of extents.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  struct buf *bp = 0;
+  struct extent *e, *last = 0;
+  uint addr;
+  int i;
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
-    return addr;
+  for(i = 0; i < NEXTENT + NXEXTENT; i++){
+    if((e = extent(ip, i, &bp)) == 0 || e->len == 0)
+      break;
+    if(bn < e->len){
+      addr = e->start + bn;
+      goto out;
+    }
+    bn -= e->len;
+    last = e;
   }
-  bn -= NDIRECT;
-
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+  if(bn != 0)
+    panic("bmap: hole");
+
+  // bn is the block after the last one. allocate the block
+  // after the last extent if it is free, or else start a new
+  // extent, if there is room for one.
+  if(last && (addr = balloc(ip->dev, last->start + last->len, 1)) != 0){
+    last->len++;
+    i--;
+  } else if(i < NEXTENT + NXEXTENT){
+    addr = balloc(ip->dev, last ? last->start + last->len : 0, 0);
+    if(e == 0){
+      // not at addr+1, where the file's next block should go.
+      ip->xblock = balloc(ip->dev, 0, 0);
+      e = extent(ip, i, &bp);
     }
-    brelse(bp);
-    return addr;
+    e->start = addr;
+    e->len = 1;
+  } else {
+    addr = 0;  // out of extents
   }
+  // the caller writes the inode; write the extent block here.
+  if(addr && i >= NEXTENT)
+    log_write(bp);
 
-  panic("bmap: out of range");
+out:
+  if(bp)
+    brelse(bp);
+  return addr;
 }
 
 // Truncate inode (discard contents).
@@ -409,27 +479,25 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
-
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
+  struct buf *bp = 0;
+  struct extent *e;
+  uint b;
+  int i;
+
+  textinval(ip);
+  for(i = 0; i < NEXTENT + NXEXTENT; i++){
+    if((e = extent(ip, i, &bp)) == 0 || e->len == 0)
+      break;
+    for(b = 0; b < e->len; b++)
+      bfree(ip->dev, e->start + b);
   }
-
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
+  if(bp)
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+  memset(ip->ext, 0, sizeof(ip->ext));
+
+  if(ip->xblock){
+    bfree(ip->dev, ip->xblock);
+    ip->xblock = 0;
   }
 
   ip->size = 0;
@@ -448,6 +516,40 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// A read that starts where the last one left off is probably
+// part of a stream through the file, so start reading the
+// blocks it covers and the NREADAHEAD after them into the
+// buffer cache, where the rest of the stream will find them.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, end, next, addr;
+
+  if(off != ip->raoff)
+    ip->raend = 0;  // not sequential; start over
+  ip->raoff = off + n;
+  if(off + n <= off)
+    return;
+
+  bn = off / BSIZE;
+  end = (off + n - 1) / BSIZE + 1 + NREADAHEAD;
+  if(end > (ip->size + BSIZE - 1) / BSIZE)
+    end = (ip->size + BSIZE - 1) / BSIZE;
+  if(bn < ip->raend)
+    bn = ip->raend;
+  // read each run of consecutive disk blocks together.
+  for(; bn < end; bn = next){
+    addr = bmap(ip, bn);
+    for(next = bn+1; next < end; next++)
+      if(bmap(ip, next) != addr + (next - bn))
+        break;
+    breadahead(ip->dev, addr, next - bn);
+  }
+  if(end > ip->raend)
+    ip->raend = end;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -455,16 +557,20 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
+  readahead(ip, off, n);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    addr = bmap(ip, off/BSIZE);
+    if(addr == 0)
+      break;
+    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
@@ -486,7 +592,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
@@ -494,8 +600,12 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  textinval(ip);
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    addr = bmap(ip, off/BSIZE);
+    if(addr == 0)
+      break;
+    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
@@ -510,7 +620,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
+  // block to ip->ext[].
   iupdate(ip);
 
   return tot;
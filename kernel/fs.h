@@ -22,11 +22,18 @@ struct superblock
     uint bmapstart;  // Block number of first free map block
 };
 
-#define FSMAGIC 0x10203040
+#define FSMAGIC 0x10203050
 
-#define NDIRECT 12
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// A run of len consecutive disk blocks, starting at start.
+struct extent
+{
+    uint start;
+    uint len;
+};
+
+#define NEXTENT 6                                // extents in the inode
+#define NXEXTENT (BSIZE / sizeof(struct extent)) // extents in its extent block
+#define MAXFILE 768                              // max file size (blocks)
 
 // On-disk inode structure
 struct dinode
@@ -36,7 +43,8 @@ struct dinode
     short minor;             // Minor device number (T_DEVICE only)
     short nlink;             // Number of links to inode in file system
     uint size;               // Size of file (bytes)
-    uint addrs[NDIRECT + 1]; // Data block addresses
+    uint xblock;             // Block holding extents after the first NEXTENT
+    struct extent ext[NEXTENT]; // Data blocks, in file order
 };
 
 // Inodes per block.
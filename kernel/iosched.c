@@ -0,0 +1,273 @@
+// Disk request scheduler.
+//
+// bio.c hands locked buffers to iosched_submit() rather than
+// to the disk driver. They wait in a queue sorted by
+// (dev, blockno), and go to the driver in one-way elevator
+// (C-SCAN) order: next is the first queued block at or after
+// where the last request ended, wrapping around to the lowest.
+// Queued buffers for consecutive blocks in the same direction
+// are merged into one driver request of up to MAXIOBLOCKS
+// blocks. At most NDISPATCH requests are at the disk at once,
+// so that buffers arriving meanwhile (from other writers, say)
+// queue up to be sorted and merged; each completion sends more.
+//
+// Interface:
+// * iosched_submit(bs, n, write) starts I/O on locked buffers.
+// * iosched_wait(b, poll) waits for I/O on b, if b has no
+//     completion function.
+// * the driver calls iosched_done(bs, n, polled) when a request
+//     finishes, and iosched_run() when it can take more.
+//
+// Waiting for a disk interrupt, and then for the scheduler to
+// run the waiter again, can take longer than a single-block
+// request itself. So in polling mode (DISKPOLL at boot, or
+// iosched_poll() at run time) waiters that ask for it spin for
+// up to POLLUSEC checking the device for completions, with the
+// device asked not to interrupt, before going to sleep.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+#include "stat.h"
+
+#define NDISPATCH 16  // max requests at the disk
+#define USEC      10  // time CSR ticks per microsecond, in qemu
+#define POLLUSEC  200 // how long to poll before sleeping
+
+struct {
+  struct spinlock lock;
+  struct buf *head;  // queued buffers, sorted, through qnext
+  int nqueued;
+  uint dev;          // where the last dispatched request ended
+  uint pos;
+  int inflight;      // requests at the disk
+  int poll;          // polling mode?
+  int npolling;      // processes polling now
+
+  // statistics, for diskstat().
+  uint64 nbuf;
+  uint64 nreq;
+  uint64 totlat;
+  uint64 maxlat;
+  uint64 npolled;
+  uint64 polllat;
+  uint64 nintr;
+  uint64 intrlat;
+} iosched;
+
+void
+ioschedinit(void)
+{
+  initlock(&iosched.lock, "iosched");
+  iosched.poll = DISKPOLL;
+}
+
+// does block blockno of dev come before block blockno2 of dev2?
+static int
+before(uint dev, uint blockno, uint dev2, uint blockno2)
+{
+  return dev < dev2 || (dev == dev2 && blockno < blockno2);
+}
+
+// Add b to the queue in order.
+// Caller must hold iosched.lock.
+static void
+enqueue(struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &iosched.head; *pp; pp = &(*pp)->qnext)
+    if(before(b->dev, b->blockno, (*pp)->dev, (*pp)->blockno))
+      break;
+  b->qnext = *pp;
+  *pp = b;
+  iosched.nqueued++;
+}
+
+// Queue the n locked buffers in bs for reading or writing,
+// and start as many requests as the disk will take.
+// Each finishes as described for bwait() and bdone() in bio.c.
+void
+iosched_submit(struct buf **bs, int n, int write)
+{
+  uint64 now = r_time();
+  int i;
+
+  acquire(&iosched.lock);
+  for(i = 0; i < n; i++){
+    bs[i]->disk = 1;
+    bs[i]->write = write;
+    bs[i]->qtime = now;
+    enqueue(bs[i]);
+  }
+  release(&iosched.lock);
+  iosched_run();
+}
+
+// Send queued buffers to the driver, while it has room.
+void
+iosched_run(void)
+{
+  struct buf *bs[MAXIOBLOCKS], **pp;
+  uint64 done;
+  int i, n;
+
+  acquire(&iosched.lock);
+  while(iosched.inflight < NDISPATCH && iosched.head){
+    // find the first block at or after the last request's end.
+    for(pp = &iosched.head; *pp; pp = &(*pp)->qnext)
+      if(!before((*pp)->dev, (*pp)->blockno, iosched.dev, iosched.pos))
+        break;
+    if(*pp == 0)
+      pp = &iosched.head;
+
+    // take it and the queued blocks that follow it on disk.
+    n = 0;
+    do {
+      bs[n++] = *pp;
+      *pp = (*pp)->qnext;
+    } while(n < MAXIOBLOCKS && *pp && (*pp)->dev == bs[0]->dev &&
+            (*pp)->blockno == bs[n-1]->blockno + 1 &&
+            (*pp)->write == bs[0]->write);
+    iosched.nqueued -= n;
+    iosched.inflight++;
+    iosched.dev = bs[0]->dev;
+    iosched.pos = bs[n-1]->blockno + 1;
+
+    // the driver's interrupt handler calls iosched_done()
+    // holding the driver's lock, so don't hold ours here.
+    done = iosched.nreq;
+    release(&iosched.lock);
+    if(virtio_disk_submit(bs, n, bs[0]->write) < 0){
+      // out of descriptors. a request finishing from now on
+      // will call iosched_run() and find these queued; but
+      // one that finished since we took them off the queue
+      // may have looked while they were gone, so try again.
+      acquire(&iosched.lock);
+      for(i = 0; i < n; i++)
+        enqueue(bs[i]);
+      iosched.inflight--;
+      if(iosched.nreq != done)
+        continue;
+      break;
+    }
+    acquire(&iosched.lock);
+  }
+  release(&iosched.lock);
+}
+
+// Called by the driver when the request for the n buffers in
+// bs finishes, as found by its interrupt handler, or by polling
+// if polled is set. Wakes up bwait()ers, and hands buffers with
+// completion functions to bdone().
+void
+iosched_done(struct buf **bs, int n, int polled)
+{
+  uint64 now = r_time();
+  uint64 lat;
+  int i;
+
+  acquire(&iosched.lock);
+  iosched.inflight--;
+  iosched.nreq++;
+  lat = (now - bs[0]->qtime) / USEC;
+  if(polled){
+    iosched.npolled++;
+    iosched.polllat += lat;
+  } else {
+    iosched.nintr++;
+    iosched.intrlat += lat;
+  }
+  for(i = 0; i < n; i++){
+    struct buf *b = bs[i];
+    lat = (now - b->qtime) / USEC;
+    iosched.nbuf++;
+    iosched.totlat += lat;
+    if(lat > iosched.maxlat)
+      iosched.maxlat = lat;
+    b->disk = 0;   // disk is done with buf
+    if(b->done)
+      bdone(b);
+    else
+      wakeup(b);
+  }
+  release(&iosched.lock);
+}
+
+// Spin checking the device for b's completion, for up to
+// POLLUSEC. Returns with b done, or not.
+static void
+pollwait(struct buf *b)
+{
+  uint64 start;
+
+  // not under iosched.lock: the driver's lock comes first.
+  if(__sync_fetch_and_add(&iosched.npolling, 1) == 0)
+    virtio_disk_intrs(0);
+
+  start = r_time();
+  while(__atomic_load_n(&b->disk, __ATOMIC_ACQUIRE) &&
+        r_time() - start < POLLUSEC*USEC)
+    virtio_disk_poll();
+
+  if(__sync_sub_and_fetch(&iosched.npolling, 1) == 0)
+    virtio_disk_intrs(1);
+
+  // a request may have finished after the device saw that
+  // we were polling but before we stopped, without an
+  // interrupt; don't leave it for one.
+  virtio_disk_poll();
+}
+
+// Wait for I/O on b, which has no completion function,
+// to finish. If poll is set, the caller is waiting for a
+// short request, which may finish soon enough to be worth
+// polling for.
+void
+iosched_wait(struct buf *b, int poll)
+{
+  if(poll && iosched.poll)
+    pollwait(b);
+
+  acquire(&iosched.lock);
+  while(b->disk)
+    sleep(b, &iosched.lock);
+  release(&iosched.lock);
+}
+
+// Report disk request statistics.
+void
+diskstat(struct diskstat *st)
+{
+  acquire(&iosched.lock);
+  st->nbuf = iosched.nbuf;
+  st->nreq = iosched.nreq;
+  st->totlat = iosched.totlat;
+  st->maxlat = iosched.maxlat;
+  st->queued = iosched.nqueued;
+  st->inflight = iosched.inflight;
+  st->npolled = iosched.npolled;
+  st->polllat = iosched.polllat;
+  st->nintr = iosched.nintr;
+  st->intrlat = iosched.intrlat;
+  st->poll = iosched.poll;
+  release(&iosched.lock);
+}
+
+// Turn polling mode on or off, and return the old mode.
+int
+iosched_poll(int on)
+{
+  int old;
+
+  acquire(&iosched.lock);
+  old = iosched.poll;
+  iosched.poll = on != 0;
+  release(&iosched.lock);
+  return old;
+}
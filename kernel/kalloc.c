@@ -1,6 +1,32 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous blocks of 2^order pages.
+//
+// All free memory belongs to a buddy allocator, which keeps
+// one free list per block order and splits and coalesces
+// blocks as they are allocated and freed.
+//
+// Single pages are the common case, so each CPU also keeps
+// its own cache of free pages, protected by its own lock,
+// so that CPUs allocating and freeing in parallel don't
+// contend. A CPU whose cache is empty refills it with a
+// batch from the buddy allocator, or if that is empty,
+// steals a batch from another CPU's cache.
+//
+// Idle CPUs also keep a pool of pages that are already
+// zeroed, so that kalloc_zeroed() on the page-fault and
+// sbrk paths doesn't have to clear a page.
+//
+// Every allocated page has a reference count, so that
+// copy-on-write fork can share a page between page tables.
+// kalloc() returns a page with one reference, krefinc()
+// adds one, and kfree() drops one, freeing the page only
+// when none remain.
+//
+// When memory runs out, the allocators take pages back from
+// the kernel's caches (unused block cache buffers, unmapped
+// text cache pages) with kreclaim() and try again.
 
 #include "types.h"
 #include "param.h"
@@ -8,25 +34,97 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "stat.h"
 
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+// how many pages a CPU moves at once between its cache
+// and the buddy allocator or another CPU's cache.
+#define NSTEAL 32
+
+// a CPU returns pages to the buddy allocator when its
+// cache grows beyond this many.
+#define NCACHE (4*NSTEAL)
+
+// idle CPUs fill the zeroed-page pool up to this many pages.
+#define NZERO 64
+
+// number of physical pages, and page index of physical address pa.
+// indices are relative to KERNBASE so that a block of order k
+// is aligned to 2^k pages in physical memory.
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PG(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PG2PA(i) (KERNBASE + (uint64)(i) * PGSIZE)
+
 struct run {
   struct run *next;
+  struct run *prev;  // only used on the buddy free lists
 };
 
+// per-CPU caches of free pages.
 struct {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;            // number of pages on freelist
+  uint64 nlock;         // times lock was acquired
+  uint64 nbusy;         // times it was held by another CPU then
+} kmem[NCPU];
+
+// the buddy allocator.
+struct {
+  struct spinlock lock;
+  struct run free[MAXORDER+1];  // circular list heads, one per order
+  int first;                    // index of first allocatable page
+  int nfree;                    // number of free pages in all blocks
+  char order[NPAGE];            // if page heads a free block, its order, else -1
+} buddy;
+
+// pages that have already been zeroed, except for the
+// struct run that links them.
+struct {
+  struct spinlock lock;
+  struct run *list;
+  int n;
+} kzero;
+
+// reference counts of allocated pages, indexed by PA2PG().
+// updated with atomic instructions rather than under a lock.
+int kref[NPAGE];
+
+static void buddy_free(void *pa, int order);
+
+// Acquire CPU id's cache lock, counting acquisitions, and
+// those that found another CPU holding it, for kmemstat().
+static void
+kmem_lock(int id)
+{
+  int busy = __atomic_load_n(&kmem[id].lock.locked, __ATOMIC_RELAXED);
+
+  acquire(&kmem[id].lock);
+  kmem[id].nlock++;
+  if(busy)
+    kmem[id].nbusy++;
+}
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  int i;
+
+  for(i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&buddy.lock, "buddy");
+  initlock(&kzero.lock, "kzero");
+  for(i = 0; i <= MAXORDER; i++){
+    buddy.free[i].next = &buddy.free[i];
+    buddy.free[i].prev = &buddy.free[i];
+  }
+  for(i = 0; i < NPAGE; i++)
+    buddy.order[i] = -1;
+  buddy.first = PA2PG(PGROUNDUP((uint64)end));
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -36,30 +134,271 @@ freerange(void *pa_start, void *pa_end)
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
   for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+    kfree_order(p, 0);
+}
+
+static void
+list_remove(struct run *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+}
+
+static void
+list_push(struct run *head, struct run *r)
+{
+  r->next = head->next;
+  r->prev = head;
+  head->next->prev = r;
+  head->next = r;
+}
+
+// Take a block of 2^order pages from the buddy free lists,
+// splitting a larger block if necessary.
+// Caller must hold buddy.lock.
+static struct run *
+buddy_alloc(int order)
+{
+  struct run *r;
+  int k;
+
+  for(k = order; k <= MAXORDER; k++)
+    if(buddy.free[k].next != &buddy.free[k])
+      break;
+  if(k > MAXORDER)
+    return 0;
+
+  r = buddy.free[k].next;
+  list_remove(r);
+  buddy.order[PA2PG(r)] = -1;
+  buddy.nfree -= 1 << order;
+
+  // return the upper halves to the free lists.
+  while(k > order){
+    k--;
+    struct run *half = (struct run*)((char*)r + ((uint64)PGSIZE << k));
+    buddy.order[PA2PG(half)] = k;
+    list_push(&buddy.free[k], half);
+  }
+  return r;
+}
+
+// Return a block of 2^order pages to the buddy free lists,
+// merging it with its buddy for as long as the buddy is free.
+// Caller must hold buddy.lock.
+static void
+buddy_free(void *pa, int order)
+{
+  int i, b;
+
+  buddy.nfree += 1 << order;
+  i = PA2PG(pa);
+  while(order < MAXORDER){
+    b = i ^ (1 << order);
+    if(b < buddy.first || b >= NPAGE || buddy.order[b] != order)
+      break;
+    list_remove((struct run*)PG2PA(b));
+    buddy.order[b] = -1;
+    if(b < i)
+      i = b;
+    order++;
+  }
+  buddy.order[i] = order;
+  list_push(&buddy.free[order], (struct run*)PG2PA(i));
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *give;
+  int id, i, n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((n = __sync_sub_and_fetch(&kref[PA2PG(pa)], 1)) > 0)
+    return;
+  if(n < 0)
+    panic("kfree: ref");
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  kmem_lock(id);
+  r->next = kmem[id].freelist;
+  kmem[id].freelist = r;
+  kmem[id].nfree++;
+
+  // hand a batch back to the buddy allocator so that
+  // it can be coalesced into larger blocks.
+  give = 0;
+  if(kmem[id].nfree > NCACHE){
+    give = kmem[id].freelist;
+    for(i = 0, r = give; i < NSTEAL - 1; i++)
+      r = r->next;
+    kmem[id].freelist = r->next;
+    kmem[id].nfree -= NSTEAL;
+    r->next = 0;
+  }
+  release(&kmem[id].lock);
+
+  if(give){
+    acquire(&buddy.lock);
+    while(give){
+      r = give;
+      give = r->next;
+      buddy_free(r, 0);
+    }
+    release(&buddy.lock);
+  }
+  pop_off();
+}
+
+// Refill CPU id's empty cache with up to NSTEAL pages
+// from the buddy allocator, and return one of them.
+// Returns 0 if the buddy allocator is empty.
+// Interrupts must be disabled.
+static struct run *
+refill(int id)
+{
+  struct run *r, *head;
+  int n;
+
+  head = 0;
+  acquire(&buddy.lock);
+  for(n = 0; n < NSTEAL; n++){
+    if((r = buddy_alloc(0)) == 0)
+      break;
+    r->next = head;
+    head = r;
+  }
+  release(&buddy.lock);
+
+  if(n > 1){
+    kmem_lock(id);
+    for(r = head->next; r->next; r = r->next)
+      ;
+    r->next = kmem[id].freelist;
+    kmem[id].freelist = head->next;
+    kmem[id].nfree += n - 1;
+    release(&kmem[id].lock);
+  }
+  return head;
+}
+
+// Move up to NSTEAL pages from another CPU's cache
+// to CPU id's cache, and return one of them.
+// Returns 0 if every cache is empty.
+// Interrupts must be disabled.
+static struct run *
+steal(int id)
+{
+  struct run *r, *head, *tail;
+  int i, n, cnt;
+
+  for(i = 1; i < NCPU; i++){
+    int victim = (id + i) % NCPU;
+
+    kmem_lock(victim);
+    n = (kmem[victim].nfree + 1) / 2;
+    if(n > NSTEAL)
+      n = NSTEAL;
+    head = kmem[victim].freelist;
+    tail = 0;
+    for(cnt = 0, r = head; cnt < n; cnt++, r = r->next)
+      tail = r;
+    if(tail){
+      kmem[victim].freelist = tail->next;
+      kmem[victim].nfree -= n;
+      tail->next = 0;
+    }
+    release(&kmem[victim].lock);
+
+    if(head == 0 || tail == 0)
+      continue;
+
+    // keep the first page, put the rest on our own list.
+    r = head;
+    if(n > 1){
+      kmem_lock(id);
+      tail->next = kmem[id].freelist;
+      kmem[id].freelist = head->next;
+      kmem[id].nfree += n - 1;
+      release(&kmem[id].lock);
+    }
+    return r;
+  }
+  return 0;
+}
+
+// Take a page from the zeroed-page pool, or return 0.
+static struct run *
+zeroed(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  r = kzero.list;
+  if(r){
+    kzero.list = r->next;
+    kzero.n--;
+  }
+  release(&kzero.lock);
+  if(r)
+    r->next = 0;
+  return r;
+}
+
+// Allocate a page without filling it with junk.
+static struct run *
+rawalloc(void)
+{
+  struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
+  kmem_lock(id);
+  r = kmem[id].freelist;
+  if(r){
+    kmem[id].freelist = r->next;
+    kmem[id].nfree--;
+  }
+  release(&kmem[id].lock);
+  if(r == 0)
+    r = refill(id);
+  if(r == 0)
+    r = steal(id);
+  pop_off();
+  return r;
+}
+
+// Free about npages pages of memory held by the kernel's
+// caches, after an allocation has failed: unmapped text pages
+// first, then unused buffers, a few at a time, since a slab
+// page is freed only when all the buffers in it are. Returns
+// 1 if it freed anything, or 0 if not, or if the caller holds
+// a spinlock (interrupts are off), which might be one that the
+// caches need.
+int
+kreclaim(int npages)
+{
+  int n, before;
+
+  if(!intr_get())
+    return 0;
+  n = textreclaim(npages);
+  before = kfreemem();
+  while(kfreemem() < before + npages - n && bshrink(npages) > 0)
+    ;
+  return n > 0 || kfreemem() > before;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -70,13 +409,201 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  r = rawalloc();
+  if(r == 0)
+    r = zeroed();  // last resort
+  if(r == 0 && kreclaim(1))
+    r = rawalloc();
 
-  if(r)
+  if(r){
     memset((char*)r, 5, PGSIZE); // fill with junk
+    kref[PA2PG(r)] = 1;
+  }
   return (void*)r;
 }
+
+// Allocate one zeroed 4096-byte page of physical memory.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  if((r = zeroed()) == 0){
+    if((r = rawalloc()) == 0 && kreclaim(1))
+      r = rawalloc();
+    if(r)
+      memset((char*)r, 0, PGSIZE);
+  }
+  if(r)
+    kref[PA2PG(r)] = 1;
+  return (void*)r;
+}
+
+// Add a reference to an allocated page.
+void
+krefinc(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefinc");
+  if(__sync_fetch_and_add(&kref[PA2PG(pa)], 1) < 1)
+    panic("krefinc: free page");
+}
+
+// Return the number of references to an allocated page.
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&kref[PA2PG(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Return the number of free pages. The count is not
+// exact, since it isn't taken under the allocator's locks.
+int
+kfreemem(void)
+{
+  int i, n;
+
+  n = buddy.nfree + kzero.n;
+  for(i = 0; i < NCPU; i++)
+    n += kmem[i].nfree;
+  return n;
+}
+
+// Zero one free page and add it to the zeroed-page pool.
+// Called by the scheduler when it has nothing to run.
+// Returns 1 if it did any work, 0 if the pool is full
+// or memory is exhausted.
+int
+kzero_refill(void)
+{
+  struct run *r;
+
+  if(kzero.n >= NZERO)   // racy peek; the pool size is only a target.
+    return 0;
+  if((r = rawalloc()) == 0)
+    return 0;
+  memset((char*)r, 0, PGSIZE);
+
+  acquire(&kzero.lock);
+  r->next = kzero.list;
+  kzero.list = r;
+  kzero.n++;
+  release(&kzero.lock);
+  return 1;
+}
+
+// Return every CPU's cached pages to the buddy allocator,
+// so that they can be coalesced into larger blocks.
+static void
+drain(void)
+{
+  struct run *r, *head;
+
+  for(int i = 0; i < NCPU; i++){
+    kmem_lock(i);
+    head = kmem[i].freelist;
+    kmem[i].freelist = 0;
+    kmem[i].nfree = 0;
+    release(&kmem[i].lock);
+
+    acquire(&buddy.lock);
+    while(head){
+      r = head;
+      head = r->next;
+      buddy_free(r, 0);
+    }
+    release(&buddy.lock);
+  }
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size. If none are free and try is set, give up;
+// otherwise work to free some first.
+static void *
+order_alloc(int order, int try)
+{
+  struct run *r;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kalloc_order");
+
+  acquire(&buddy.lock);
+  r = buddy_alloc(order);
+  release(&buddy.lock);
+
+  if(r == 0 && !try){
+    // take memory back from the kernel's caches; and free
+    // pages may be sitting in the per-CPU caches, preventing
+    // their buddies from coalescing.
+    kreclaim(1 << order);
+    if(order > 0)
+      drain();
+    acquire(&buddy.lock);
+    r = buddy_alloc(order);
+    release(&buddy.lock);
+  }
+
+  if(r){
+    memset((char*)r, 5, (uint64)PGSIZE << order); // fill with junk
+    for(int i = 0; i < (1 << order); i++)
+      kref[PA2PG(r) + i] = 1;
+  }
+  return (void*)r;
+}
+
+// Allocate 2^order physically contiguous pages,
+// aligned to their size.
+// Returns a pointer that the kernel can use.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_order(int order)
+{
+  return order_alloc(order, 0);
+}
+
+// Like kalloc_order(), but only if such a block is free
+// now, for callers that can make do without one.
+void *
+kalloc_order_try(int order)
+{
+  return order_alloc(order, 1);
+}
+
+// Free a block of 2^order pages returned by kalloc_order().
+void
+kfree_order(void *pa, int order)
+{
+  if(order < 0 || order > MAXORDER)
+    panic("kfree_order");
+  if(((uint64)pa % ((uint64)PGSIZE << order)) != 0 ||
+     (char*)pa < end || (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("kfree_order");
+
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, (uint64)PGSIZE << order);
+
+  for(int i = 0; i < (1 << order); i++)
+    kref[PA2PG(pa) + i] = 0;
+
+  acquire(&buddy.lock);
+  buddy_free(pa, order);
+  release(&buddy.lock);
+}
+
+// Report page allocator statistics.
+void
+kmemstat(struct kmemstat *st)
+{
+  int i;
+
+  st->nfree = kfreemem();
+  st->ncpu = NCPU < KSTATNCPU ? NCPU : KSTATNCPU;
+  for(i = 0; i < st->ncpu; i++){
+    acquire(&kmem[i].lock);
+    st->cpu[i].nfree = kmem[i].nfree;
+    st->cpu[i].nlock = kmem[i].nlock;
+    st->cpu[i].nbusy = kmem[i].nbusy;
+    release(&kmem[i].lock);
+  }
+}
@@ -6,118 +6,299 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "stat.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. A transaction only commits when none of its FS system
+// calls are active. Thus there is never any reasoning required
+// about whether a commit might write an uncommitted system
+// call's updates to disk.
+//
+// Commits are done by the log flusher, a kernel thread, so
+// FS system calls return without waiting for the disk;
+// log_sync() (for fsync()) waits until they are on disk.
+//
+// The log is double-buffered: a commit first copies its blocks
+// into a snapshot, and from then on writes only the snapshot,
+// so new FS system calls can start the next transaction
+// (changing the same blocks in the cache, even) while the
+// previous one is written to disk. Transactions commit one at
+// a time; whatever accumulates meanwhile commits next.
+//
+// Checkpointing is lazy: a committed transaction stays in the
+// log, its blocks pinned in the cache, and the next one is
+// appended after it, wrapping around the log area. The latest
+// committed contents of each logged block are kept in memory,
+// and written to the block's home location only when the log
+// is too full for the next transaction, or no FS system call
+// has started for LOGIDLE ticks. A bitmap or inode block changed by many transactions
+// in a row is thus written home once rather than after every
+// commit.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// But if it thinks the current transaction is close to
+// running out of log space, or the flusher is taking its
+// snapshot, it sleeps until that is done. begin_op()
+// reserves MAXOPBLOCKS blocks; a system call that may write
+// more, such as a large write(), reserves them with
+// begin_opn(), up to log_maxop().
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
-
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// Its size is chosen by mkfs (sb.nlog), and a transaction may
+// take up to half of it, or MAXLOGSIZE blocks. The on-disk
+// log format:
+//   header block, containing the checkpoint: the position and
+//     sequence number of the oldest transaction in the log
+//   a circular area of transactions, each:
+//     descriptor block: magic, sequence number, block #s for A, B, ...,
+//       and a checksum of all that and the blocks' contents
+//     block A
+//     block B
+//     ...
+// Recovery installs transactions from the checkpoint on, while
+// each descriptor has the next sequence number and the right
+// checksum; the latest copy of a block wins. The checksum shows
+// whether all of a transaction reached the disk, so a commit
+// writes the descriptor along with the blocks, in one go,
+// rather than waiting for the blocks before writing it.
+
+#define LOGMAGIC 0x10c0ffee
+
+// A transaction's logged block #s, kept in memory before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[MAXLOGSIZE];
+};
+
+// Contents of a transaction's descriptor block.
+struct logdesc {
+  uint magic;  // LOGMAGIC
+  uint seq;
+  uint cksum;
+  int n;
+  int block[MAXLOGSIZE];
+};
+
+// Contents of the header block.
+struct logckpt {
+  uint seq;    // sequence number of the transaction at pos
+  uint pos;    // where the oldest transaction starts in the log area
 };
 
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int ring;        // blocks in the circular area, after the header
+  int max;         // most blocks a transaction may log
+  uint head;       // where the next transaction goes in it
+  uint seq;        // that transaction's sequence number
+  int used;        // blocks taken by transactions not yet installed
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks they have reserved
+  uint lastop;     // ticks when the last one started
+  int snapshotting; // flusher is copying blocks; don't change them.
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // the transaction FS sys calls are adding to
+  int txn;              // its number
+  int committed;        // number of the last transaction on disk
+
+  // the transaction being committed.
+  struct logheader clh;
+  int ctxn;                         // its number
+  struct buf *pinned[MAXLOGSIZE];   // its blocks in the cache
+  struct buf snap[MAXLOGSIZE];      // copies of their contents
+  struct buf desc;                  // its descriptor block
+
+  // committed transactions not yet installed at home.
+  int nck;                          // number of distinct blocks they wrote
+  int ckblock[MAXLOGSIZE];          // those blocks
+  struct buf *ckpinned[MAXLOGSIZE]; // in the cache
+  struct buf ckbuf[MAXLOGSIZE];     // their latest committed contents
+
+  // statistics, for logstat().
+  uint64 ncommit;
+  uint64 nckpt;
+  uint64 nhome;
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void logflusher(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
-
+  if (sizeof(struct logdesc) >= BSIZE)
+    panic("initlog: too big logdesc");
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  log.ring = log.size - 1;
+  // two of the largest transactions fit in the ring, so one
+  // can be appended without checkpointing the other.
+  log.max = log.ring / 2 - 1;
+  if (log.max > MAXLOGSIZE)
+    log.max = MAXLOGSIZE;
+  if (log.max < MAXOPBLOCKS)
+    panic("initlog: log too small");
   log.dev = dev;
+  initsleeplock(&log.desc.lock, "logdesc");
+  log.desc.dev = dev;
+  for (int i = 0; i < MAXLOGSIZE; i++) {
+    initsleeplock(&log.snap[i].lock, "logsnap");
+    log.snap[i].dev = dev;
+    initsleeplock(&log.ckbuf[i].lock, "logckpt");
+    log.ckbuf[i].dev = dev;
+  }
   recover_from_log();
+  log.txn = 1;
+  log.committed = 0;
+  kthread_create("logflush", logflusher);
 }
 
-// Copy committed blocks from log to their home location
+// Disk block number of position pos in the log area.
+static uint
+logblock(uint pos)
+{
+  return log.start + 1 + pos % log.ring;
+}
+
+// Start reading the n log blocks from position pos on into bs.
 static void
-install_trans(int recovering)
+read_log(uint pos, int n, struct buf **bs)
 {
-  int tail;
+  int m;
+
+  pos %= log.ring;
+  m = n;
+  if (pos + m > log.ring)
+    m = log.ring - pos;  // wraps around
+  breadv_async(log.dev, logblock(pos), m, bs);
+  if (m < n)
+    breadv_async(log.dev, logblock(0), n - m, bs + m);
+}
+
+// Checksum of transaction seq, with the n blocks listed in
+// block[] and their contents in bs: 32-bit FNV-1a, a word at
+// a time.
+static uint
+cksum(uint seq, int n, int *block, struct buf **bs)
+{
+  uint h = 2166136261;
+  int i, j;
 
+  h = (h ^ seq) * 16777619;
+  h = (h ^ n) * 16777619;
+  for (i = 0; i < n; i++) {
+    uint *w = (uint *) bs[i]->data;
+    h = (h ^ block[i]) * 16777619;
+    for (j = 0; j < BSIZE/sizeof(uint); j++)
+      h = (h ^ w[j]) * 16777619;
+  }
+  return h;
+}
+
+// Copy the blocks of the transaction in log.lh, at position
+// pos, from log to their home location, during recovery, if
+// they match its checksum sum; return 0 if not. Start all the
+// reads of the log, then all the writes home, so that the disk
+// has many requests to work on at once.
+static int
+install_trans(uint pos, uint sum)
+{
+  struct buf *lbuf[MAXLOGSIZE], *dbuf[MAXLOGSIZE];
+  int tail, i, nd;
+
+  read_log(pos, log.lh.n, lbuf); // read log blocks
+  for (tail = 0; tail < log.lh.n; tail++)
+    bwait(lbuf[tail]);
+  if (cksum(log.seq, log.lh.n, log.lh.block, lbuf) != sum) {
+    // never committed: the crash came while it was being written.
+    for (tail = 0; tail < log.lh.n; tail++)
+      brelse(lbuf[tail]);
+    return 0;
+  }
+  nd = 0;
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+    // a block listed twice is already locked in dbuf[];
+    // the later copy wins.
+    for (i = 0; i < nd; i++)
+      if (dbuf[i]->blockno == log.lh.block[tail])
+        break;
+    if (i == nd)
+      dbuf[nd++] = bread(log.dev, log.lh.block[tail]); // read dst
+    memmove(dbuf[i]->data, lbuf[tail]->data, BSIZE);  // copy block to dst
+    brelse(lbuf[tail]);
+  }
+  bwritev_async(dbuf, nd);  // write dsts to disk
+  for (i = 0; i < nd; i++) {
+    bwait(dbuf[i]);
+    brelse(dbuf[i]);
   }
+  return 1;
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the checkpoint from the header block.
 static void
 read_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
+  struct logckpt *ck = (struct logckpt *) (buf->data);
+  log.seq = ck->seq;
+  log.head = ck->pos % log.ring;
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write the header block, making the log start at log.head:
+// every transaction before it has been installed.
 static void
 write_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
-  }
+  struct logckpt *ck = (struct logckpt *) (buf->data);
+  ck->seq = log.seq;
+  ck->pos = log.head;
   bwrite(buf);
   brelse(buf);
 }
 
+// Read the descriptor at log.head into log.lh and *sum, and
+// return 1 if it is that of transaction log.seq.
+static int
+read_desc(uint *sum)
+{
+  struct buf *buf = bread(log.dev, logblock(log.head));
+  struct logdesc *d = (struct logdesc *) (buf->data);
+  int i, ok;
+
+  ok = d->magic == LOGMAGIC && d->seq == log.seq &&
+    d->n >= 0 && d->n <= MAXLOGSIZE;
+  if (ok) {
+    log.lh.n = d->n;
+    *sum = d->cksum;
+    for (i = 0; i < log.lh.n; i++)
+      log.lh.block[i] = d->block[i];
+  }
+  brelse(buf);
+  return ok;
+}
+
 static void
 recover_from_log(void)
 {
+  uint sum;
+
   read_head();
-  install_trans(1); // if committed, copy from log to disk
+  while (read_desc(&sum) && install_trans(log.head+1, sum)) {
+    // committed; copied from log to disk
+    log.head = (log.head + log.lh.n + 1) % log.ring;
+    log.seq++;
+  }
   log.lh.n = 0;
   write_head(); // clear the log
 }
@@ -126,15 +307,27 @@ recover_from_log(void)
 void
 begin_op(void)
 {
+  begin_opn(MAXOPBLOCKS);
+}
+
+// called at the start of an FS system call that may log
+// up to n blocks, at most log_maxop().
+void
+begin_opn(int n)
+{
+  if(n > log.max)
+    panic("begin_opn");
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.snapshotting){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.reserved + n > log.max){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
+      log.lastop = ticks;
       release(&log.lock);
       break;
     }
@@ -142,69 +335,240 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  end_opn(MAXOPBLOCKS);
+}
 
+// called at the end of an FS system call begun with
+// begin_opn(n). if this was the last outstanding operation,
+// the transaction can commit; wake up the log flusher to do it.
+void
+end_opn(int n)
+{
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+  log.reserved -= n;
+  if(log.outstanding == 0)
+    wakeup(&log.lh);
+  // begin_op() may be waiting for log space,
+  // and decrementing log.reserved has decreased
+  // the amount of reserved space.
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// Most blocks one FS system call may reserve with begin_opn().
+int
+log_maxop(void)
+{
+  return log.max;
+}
+
+// Wait until the FS system calls that have ended so far
+// are on disk.
+void
+log_sync(void)
+{
+  int want;
+
+  acquire(&log.lock);
+  want = log.lh.n > 0 ? log.txn : log.txn - 1;
+  while(log.committed < want){
+    wakeup(&log.lh);
+    sleep(&log.committed, &log.lock);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Copy the blocks of the current transaction, which has no
+// outstanding FS sys calls, into the snapshot, and make it
+// the committing transaction.
+static void
+snapshot(void)
+{
+  int tail;
+
+  for (tail = 0; tail < log.lh.n; tail++) {
+    struct buf *b = bread(log.dev, log.lh.block[tail]); // cache block
+    memmove(log.snap[tail].data, b->data, BSIZE);
+    log.pinned[tail] = b;  // log_write() pinned it
+    brelse(b);
   }
+  log.clh = log.lh;
 }
 
-// Copy modified blocks from cache to log.
+// Write the snapshot to the log, after its descriptor, with a
+// few large writes all in flight at once.
 static void
 write_log(void)
 {
+  struct logdesc *d = (struct logdesc *) (log.desc.data);
+  struct buf *bs[MAXLOGSIZE+1];
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < log.clh.n; tail++) {
+    bs[tail+1] = &log.snap[tail];
+    bs[tail+1]->blockno = logblock(log.head+tail+1);  // log block
+  }
+  acquiresleep(&log.desc.lock);
+  bs[0] = &log.desc;
+  bs[0]->blockno = logblock(log.head);
+  d->magic = LOGMAGIC;
+  d->seq = log.seq;
+  d->n = log.clh.n;
+  for (tail = 0; tail < log.clh.n; tail++)
+    d->block[tail] = log.clh.block[tail];
+  d->cksum = cksum(log.seq, log.clh.n, log.clh.block, bs+1);
+  bwritev_async(bs, log.clh.n+1);
+  for (tail = 0; tail < log.clh.n+1; tail++)
+    bwait(bs[tail]);
+  releasesleep(&log.desc.lock);
+}
+
+// Write the latest committed contents of the blocks of the
+// transactions in the log to their home locations, and empty
+// the log. The copies in the cache may have changed since, in
+// later transactions, and so can't be written instead.
+static void
+checkpoint(void)
+{
+  struct buf *bs[MAXLOGSIZE];
+  int i;
+
+  for (i = 0; i < log.nck; i++) {
+    bs[i] = &log.ckbuf[i];
+    acquiresleep(&bs[i]->lock);
+    bs[i]->blockno = log.ckblock[i];  // home
+  }
+  bwritev_async(bs, log.nck);
+  for (i = 0; i < log.nck; i++) {
+    bwait(bs[i]);
+    releasesleep(&bs[i]->lock);
+    bunpin(log.ckpinned[i]);
+  }
+  acquire(&log.lock);
+  log.nckpt++;
+  log.nhome += log.nck;
+  log.nck = 0;
+  release(&log.lock);
+  log.used = 0;
+  write_head();    // Erase the transactions from the log
+}
+
+// Record the committed snapshot as the latest contents of its
+// blocks, to be installed by checkpoint(). A block logged again
+// is pinned only once.
+static void
+absorb(void)
+{
+  int tail, i;
+
+  for (tail = 0; tail < log.clh.n; tail++) {
+    for (i = 0; i < log.nck; i++)
+      if (log.ckblock[i] == log.clh.block[tail])
+        break;
+    if (i == log.nck) {
+      log.ckblock[i] = log.clh.block[tail];
+      log.ckpinned[i] = log.pinned[tail];
+      log.nck++;
+    } else {
+      bunpin(log.pinned[tail]);
+    }
+    acquiresleep(&log.ckbuf[i].lock);
+    memmove(log.ckbuf[i].data, log.snap[tail].data, BSIZE);
+    releasesleep(&log.ckbuf[i].lock);
   }
 }
 
+// Write the committing transaction to disk, after the
+// transactions already in the log.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+  int tail;
+
+  if (log.used + log.clh.n + 1 > log.ring || log.nck + log.clh.n > MAXLOGSIZE)
+    checkpoint();  // no room in the log
+  for (tail = 0; tail < log.clh.n; tail++)
+    acquiresleep(&log.snap[tail].lock);
+  write_log();     // Write snapshot and descriptor -- the real commit
+  log.head = (log.head + log.clh.n + 1) % log.ring;
+  log.used += log.clh.n + 1;
+  log.seq++;
+  acquire(&log.lock);
+  log.committed = log.ctxn;
+  log.ncommit++;
+  wakeup(&log.committed);  // for log_sync()
+  release(&log.lock);
+  absorb();
+  for (tail = 0; tail < log.clh.n; tail++)
+    releasesleep(&log.snap[tail].lock);
+  log.clh.n = 0;
+}
+
+// The log flusher: a kernel thread that commits each
+// transaction once its last FS system call has ended,
+// so that those system calls needn't wait for the disk.
+// When there is nothing to commit and no FS system call
+// has started for LOGIDLE ticks, it checkpoints.
+static void
+logflusher(void)
+{
+  acquire(&log.lock);
+  for(;;){
+    while(log.outstanding > 0 || log.lh.n == 0){
+      if(log.outstanding == 0 && log.nck > 0 &&
+         ticks - log.lastop >= LOGIDLE){
+        release(&log.lock);
+        checkpoint();
+        acquire(&log.lock);
+        continue;
+      }
+      sleep(&log.lh, &log.lock);
+    }
+
+    log.snapshotting = 1;
+    release(&log.lock);
+    snapshot();
+    acquire(&log.lock);
+    log.ctxn = log.txn++;
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.snapshotting = 0;
+    wakeup(&log);  // begin_op() can go on, in a new transaction
+    release(&log.lock);
+
+    commit();
+    acquire(&log.lock);
   }
 }
 
+// Called by clockintr() on each tick: wake the log flusher to
+// checkpoint once the file system has been idle for LOGIDLE
+// ticks. Peeks without log.lock; a needless wakeup is harmless,
+// and a missed one happens on the next tick.
+void
+logtick(void)
+{
+  if(log.nck > 0 && log.outstanding == 0 && ticks - log.lastop >= LOGIDLE)
+    wakeup(&log.lh);
+}
+
+void
+logstat(struct logstat *st)
+{
+  acquire(&log.lock);
+  st->ncommit = log.ncommit;
+  st->nckpt = log.nckpt;
+  st->nhome = log.nhome;
+  st->nck = log.nck;
+  release(&log.lock);
+}
+
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// The log flusher will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -217,7 +581,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.max)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -233,4 +597,3 @@ log_write(struct buf *b)
   }
   release(&log.lock);
 }
-
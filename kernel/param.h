@@ -1,13 +1,21 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // typical number of active i-nodes (not a limit)
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
+#define NSEG          4  // max loadable segments per program
+#define NVMA         16  // max mmap() regions per process
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define MAXLOGSIZE   100 // max data blocks in a log transaction
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
+#define LOGIDLE      10    // idle ticks before the log is checkpointed
+#define NBUFMAX      4096  // maximum size of disk block cache
+#define BUFMINFREE   512   // free pages the block cache leaves alone
+#define NREADAHEAD   8     // blocks readi() reads ahead of a sequential reader
+#define MAXIOBLOCKS  8     // max blocks in one disk request
+#define DISKPOLL     0     // poll for single-block disk I/O at boot?
+#define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define MAXORDER     10    // largest kalloc_order() block is 2^MAXORDER pages
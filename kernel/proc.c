@@ -19,6 +19,7 @@ extern void forkret(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
+extern pagetable_t kernel_pagetable; // vm.c
 
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
@@ -163,6 +164,7 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
   p->state = UNUSED;
 }
 
@@ -248,20 +250,30 @@ userinit(void)
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only reserves the address space; vmfault()
+// allocates each page when it is first touched.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
+  struct seg *s;
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if(sz + n > mmapbase(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    // memory regrown later must read as zero, not as the file.
+    for(s = p->seg; s < &p->seg[p->nseg]; s++){
+      if(s->va >= sz)
+        s->filesz = 0;
+      else if(s->va + s->filesz > sz)
+        s->filesz = sz - s->va;
+    }
   }
   p->sz = sz;
   return 0;
@@ -276,18 +288,26 @@ fork(void)
   struct proc *np;
   struct proc *p = myproc();
 
+  // the child reads shared mappings from their files.
+  mmapsync(p);
+
   // Allocate process.
   if((np = allocproc()) == 0){
     return -1;
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  if(uvmcopy(p->pagetable, np->pagetable, 0, p->sz) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
+  if(mmapfork(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -300,6 +320,10 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  if(p->exe)
+    np->exe = idup(p->exe);
+  memmove(np->seg, p->seg, sizeof(p->seg));
+  np->nseg = p->nseg;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -344,6 +368,8 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  munmapall(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -355,8 +381,12 @@ exit(int status)
 
   begin_op();
   iput(p->cwd);
+  if(p->exe)
+    iput(p->exe);
   end_op();
   p->cwd = 0;
+  p->exe = 0;
+  p->nseg = 0;
 
   acquire(&wait_lock);
 
@@ -387,6 +417,8 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  if(addr != 0)
+    uvmprefault(addr, sizeof(int));
   acquire(&wait_lock);
 
   for(;;){
@@ -434,20 +466,25 @@ wait(uint64 addr)
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
+//  - if nothing was runnable, do some background
+//    work, such as zeroing free pages.
 void
 scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int found;
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
+    found = 0;
     for(p = proc; p < &proc[NPROC]; p++) {
       acquire(&p->lock);
       if(p->state == RUNNABLE) {
+        found = 1;
         // Switch to chosen process.  It is the process's job
         // to release its lock and then reacquire it
         // before jumping back to us.
@@ -461,6 +498,12 @@ scheduler(void)
       }
       release(&p->lock);
     }
+
+    if(!found){
+      if(kfreemem() < BUFMINFREE)
+        bshrink(32);
+      kzero_refill();
+    }
   }
 }
 
@@ -523,6 +566,37 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kfn();
+  panic("kthreadret");
+}
+
+// Start a kernel thread: a process with no user memory that
+// runs fn() in the kernel. fn must never return. A kernel
+// thread has no parent, so no one waits for it.
+void
+kthread_create(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread_create");
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
@@ -641,8 +715,12 @@ procdump(void)
   };
   struct proc *p;
   char *state;
+  int npage, nsuper;
 
   printf("\n");
+  npage = nsuper = 0;
+  vmcount(kernel_pagetable, &npage, &nsuper);
+  printf("kernel: %d pages, %d superpages\n", npage, nsuper);
   for(p = proc; p < &proc[NPROC]; p++){
     if(p->state == UNUSED)
       continue;
@@ -651,6 +729,11 @@ procdump(void)
     else
       state = "???";
     printf("%d %s %s", p->pid, state, p->name);
+    if(p->pagetable){
+      npage = nsuper = 0;
+      vmcount(p->pagetable, &npage, &nsuper);
+      printf(" (%d pages, %d superpages)", npage, nsuper);
+    }
     printf("\n");
   }
 }
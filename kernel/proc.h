@@ -80,6 +80,24 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A file-backed part of the program image. Its pages are
+// read from the executable when first touched (see execfault()).
+struct seg {
+  uint64 va;                   // page-aligned start address
+  uint64 filesz;               // bytes backed by the file
+  uint off;                    // file offset of va
+};
+
+// A file mapped by mmap(), between the heap and TRAPFRAME.
+struct vma {
+  uint64 addr;                 // page-aligned start
+  uint64 len;                  // page-aligned length; 0 if unused
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;
+  uint off;                    // file offset of addr
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -104,5 +122,17 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct inode *exe;           // Executable, for demand paging
+  struct seg seg[NSEG];        // File-backed segments of the image
+  int nseg;
+  struct vma vma[NVMA];        // Mapped files
+
+  // last page translated by copyin()/copyout(); see uvmxlate().
+  uint64 xva;                  // user address of the page or superpage
+  uint64 xpa;                  // its physical address
+  uint64 xsize;                // its size
+  int xwrite;                  // writable?
+  uint64 xgen;                 // vmgen when it was translated
+  void (*kfn)(void);           // Kernel thread's function, or 0
   char name[16];               // Process name (debugging)
 };
@@ -0,0 +1,250 @@
+// Object caches for small, fixed-size kernel objects
+// (struct file, struct inode, struct pipe, ...).
+//
+// Each cache carves whole pages from kalloc() into slabs of
+// equal-sized objects, so that small objects are packed
+// densely instead of taking a page (or a static table slot)
+// each. A slab's header sits at the start of its page, so
+// the slab of any object is found by rounding its address
+// down to a page boundary.
+//
+// Each CPU keeps a small magazine of free objects per cache,
+// so most allocations and frees touch neither the cache lock
+// nor another CPU's memory. Caches of large objects (a
+// quarter page or more) have no magazines: a slab holds only
+// a few such objects, and a magazine holding one would keep
+// the slab's page from being freed.
+//
+// Interface:
+// * kmem_cache_create(name, size) makes a cache; caches live forever.
+// * kmem_cache_alloc(c) returns an uninitialized object, or 0.
+// * kmem_cache_free(c, obj) returns an object to its cache.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NKCACHE 16  // maximum number of object caches
+#define MAGSIZE 16  // objects per per-CPU magazine
+
+struct object {
+  struct object *next;
+};
+
+struct slab {
+  struct slab *next;        // on cache's list of partially free slabs
+  struct object *freelist;  // free objects in this slab
+  int inuse;                // number of objects allocated or in magazines
+};
+
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint size;               // object size, rounded up
+  int perslab;             // objects per slab
+  int usemag;              // use per-CPU magazines?
+  struct slab *partial;    // slabs with free objects
+  struct magazine mag[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NKCACHE];
+  int n;
+} kcaches;
+
+// offset of the first object in a slab page.
+#define SLABHDR ((sizeof(struct slab) + 15) & ~15)
+
+void
+slabinit(void)
+{
+  initlock(&kcaches.lock, "kcaches");
+}
+
+// Create a cache of objects of the given size.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 15) & ~15;
+  if(size < sizeof(struct object) || size > PGSIZE - SLABHDR)
+    panic("kmem_cache_create: size");
+
+  acquire(&kcaches.lock);
+  if(kcaches.n >= NKCACHE)
+    panic("kmem_cache_create: too many caches");
+  c = &kcaches.cache[kcaches.n++];
+  release(&kcaches.lock);
+
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+  c->usemag = size < PGSIZE/4;
+  c->partial = 0;
+  for(int i = 0; i < NCPU; i++)
+    c->mag[i].n = 0;
+  return c;
+}
+
+// Allocate a new slab page and put it on c's partial list.
+// Caller must hold c->lock.
+static struct slab*
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  struct object *o;
+  char *p;
+  int i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->freelist = 0;
+  s->inuse = 0;
+  p = (char*)s + SLABHDR;
+  for(i = 0; i < c->perslab; i++, p += c->size){
+    o = (struct object*)p;
+    o->next = s->freelist;
+    s->freelist = o;
+  }
+  s->next = c->partial;
+  c->partial = s;
+  return s;
+}
+
+// Take one object from c's slabs, or return 0.
+// Caller must hold c->lock.
+static void*
+slab_get(struct kmem_cache *c)
+{
+  struct slab *s;
+  struct object *o;
+
+  if((s = c->partial) == 0 && (s = slab_grow(c)) == 0)
+    return 0;
+  o = s->freelist;
+  s->freelist = o->next;
+  s->inuse++;
+  if(s->freelist == 0)
+    c->partial = s->next;  // slab is now full
+  return o;
+}
+
+// Move up to n objects from c's slabs into magazine m.
+// Caller must hold c->lock.
+static void
+mag_fill(struct kmem_cache *c, struct magazine *m, int n)
+{
+  void *o;
+
+  while(n > 0 && m->n < MAGSIZE){
+    if((o = slab_get(c)) == 0)
+      break;
+    m->obj[m->n++] = o;
+    n--;
+  }
+}
+
+// Return object o to its slab, freeing the slab's page
+// if no objects in it remain in use.
+// Caller must hold c->lock.
+static void
+slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s, **pp;
+  struct object *o;
+
+  s = (struct slab*)PGROUNDDOWN((uint64)obj);
+  o = (struct object*)obj;
+  if(s->freelist == 0){
+    // slab was full; it has a free object again.
+    s->next = c->partial;
+    c->partial = s;
+  }
+  o->next = s->freelist;
+  s->freelist = o;
+  if(--s->inuse == 0){
+    for(pp = &c->partial; *pp != s; pp = &(*pp)->next)
+      ;
+    *pp = s->next;
+    kfree(s);
+  }
+}
+
+static void*
+cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj;
+
+  if(!c->usemag){
+    acquire(&c->lock);
+    obj = slab_get(c);
+    release(&c->lock);
+    return obj;
+  }
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0){
+    acquire(&c->lock);
+    mag_fill(c, m, MAGSIZE/2);
+    release(&c->lock);
+  }
+  obj = 0;
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  pop_off();
+  return obj;
+}
+
+// Allocate an object from c. If memory has run out, take some
+// back from the kernel's caches and try again; slab pages are
+// allocated under c->lock, where kalloc() can't do that.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  void *obj;
+
+  if((obj = cache_alloc(c)) == 0 && kreclaim(1))
+    obj = cache_alloc(c);
+  return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  if(obj == 0 || (char*)obj < (char*)PGROUNDDOWN((uint64)obj) + SLABHDR)
+    panic("kmem_cache_free");
+
+  if(!c->usemag){
+    acquire(&c->lock);
+    slab_put(c, obj);
+    release(&c->lock);
+    return;
+  }
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE){
+    // magazine is full; return half of it to the slabs.
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      slab_put(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = obj;
+  pop_off();
+}
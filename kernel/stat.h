@@ -9,3 +9,48 @@ struct stat {
   short nlink; // Number of links to file
   uint64 size; // Size of file in bytes
 };
+
+// Buffer cache statistics, from bstat().
+struct bstat {
+  uint64 hits;      // lookups that found the block cached
+  uint64 misses;    // lookups that had to read the block
+  uint64 ghosthits; // misses on blocks recently recycled from A1in
+  uint64 evictions; // buffers recycled
+  int nbuf;         // buffers in the cache
+  int nin;          // buffers on the A1in queue
+};
+
+// Log statistics, from logstat().
+struct logstat {
+  uint64 ncommit;   // transactions committed
+  uint64 nckpt;     // checkpoints
+  uint64 nhome;     // blocks they wrote to their home locations
+  int nck;          // blocks committed but not yet written home
+};
+
+// Page allocator statistics, from kmemstat().
+#define KSTATNCPU 8         // most CPUs reported on
+struct kmemstat {
+  int nfree;                // free pages
+  int ncpu;                 // entries in cpu[]
+  struct {
+    int nfree;              // pages in the CPU's free page cache
+    uint64 nlock;           // acquisitions of the cache's lock
+    uint64 nbusy;           // of those, how many found it held
+  } cpu[KSTATNCPU];
+};
+
+// Disk request statistics, from diskstat().
+struct diskstat {
+  uint64 nbuf;      // blocks read or written
+  uint64 nreq;      // disk requests that carried them
+  uint64 totlat;    // total of blocks' queue-to-done time, in usec
+  uint64 maxlat;    // longest of those times, in usec
+  int queued;       // blocks waiting to go to the disk
+  int inflight;     // requests at the disk
+  int poll;         // polling mode?
+  uint64 npolled;   // requests whose completion was found by polling
+  uint64 polllat;   // their total latency, in usec
+  uint64 nintr;     // requests whose completion was found by interrupt
+  uint64 intrlat;   // their total latency, in usec
+};
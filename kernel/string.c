@@ -38,14 +38,39 @@ memmove(void *dst, const void *src, uint n)
   
   s = src;
   d = dst;
+  // if s and d are equally aligned, copy the middle a
+  // 64-bit word at a time.
   if(s < d && s + n > d){
     s += n;
     d += n;
+    if((((uint64)s ^ (uint64)d) & 7) == 0){
+      while(n > 0 && ((uint64)s & 7) != 0){
+        *--d = *--s;
+        n--;
+      }
+      for(; n >= 8; n -= 8){
+        s -= 8;
+        d -= 8;
+        *(uint64*)d = *(const uint64*)s;
+      }
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if((((uint64)s ^ (uint64)d) & 7) == 0){
+      while(n > 0 && ((uint64)s & 7) != 0){
+        *d++ = *s++;
+        n--;
+      }
+      for(; n >= 8; n -= 8){
+        *(uint64*)d = *(const uint64*)s;
+        s += 8;
+        d += 8;
+      }
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
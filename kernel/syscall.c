@@ -104,6 +104,14 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_wait(void);
 extern uint64 sys_write(void);
 extern uint64 sys_uptime(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_bstat(void);
+extern uint64 sys_diskstat(void);
+extern uint64 sys_diskpoll(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_kmemstat(void);
+extern uint64 sys_logstat(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -127,6 +135,14 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_bstat]   sys_bstat,
+[SYS_diskstat] sys_diskstat,
+[SYS_diskpoll] sys_diskpoll,
+[SYS_fsync]   sys_fsync,
+[SYS_kmemstat] sys_kmemstat,
+[SYS_logstat] sys_logstat,
 };
 
 void
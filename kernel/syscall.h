@@ -20,3 +20,11 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_mmap   22
+#define SYS_munmap 23
+#define SYS_bstat  24
+#define SYS_diskstat 25
+#define SYS_diskpoll 26
+#define SYS_fsync  27
+#define SYS_kmemstat 28
+#define SYS_logstat 29
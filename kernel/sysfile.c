@@ -8,6 +8,7 @@
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
 #include "stat.h"
 #include "spinlock.h"
 #include "proc.h"
@@ -115,6 +116,73 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+// Wait until the file system's changes so far, including
+// those to the file, are on disk.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  log_sync();
+  return 0;
+}
+
+uint64
+sys_bstat(void)
+{
+  struct bstat st;
+  uint64 addr; // user pointer to struct bstat
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  bstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+uint64
+sys_diskstat(void)
+{
+  struct diskstat st;
+  uint64 addr; // user pointer to struct diskstat
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  diskstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+uint64
+sys_logstat(void)
+{
+  struct logstat st;
+  uint64 addr; // user pointer to struct logstat
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  logstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// Turn polling for disk completions on or off;
+// return the old setting.
+uint64
+sys_diskpoll(void)
+{
+  int on;
+
+  if(argint(0, &on) < 0)
+    return -1;
+  return iosched_poll(on);
+}
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
@@ -484,3 +552,296 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// Memory-mapped files.
+//
+// mmap() only records a vma; pages are read from the file
+// through the buffer cache when first touched (mmapfault()).
+// MAP_PRIVATE pages are private copies. MAP_SHARED pages are
+// mapped read-only until written, so that only written pages
+// are copied back to the file, when they are unmapped, when
+// the process exits or execs, or before it forks; a child
+// re-reads shared mappings from the file rather than sharing
+// the parent's pages.
+
+// Return the mapping containing va, or 0.
+static struct vma*
+vmafind(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// Lowest address used by mmap(), which bounds the heap.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = TRAPFRAME;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len && v->addr < base)
+      base = v->addr;
+  return base;
+}
+
+// Find the highest free range of len bytes between the
+// heap and TRAPFRAME. Returns 0 if there is none.
+static uint64
+vmaplace(struct proc *p, uint64 len)
+{
+  struct vma *w;
+  uint64 a, top, best;
+  int i;
+
+  best = 0;
+  for(i = -1; i < NVMA; i++){
+    // try just below TRAPFRAME and just below each mapping.
+    if(i < 0)
+      top = TRAPFRAME;
+    else if(p->vma[i].len)
+      top = p->vma[i].addr;
+    else
+      continue;
+    if(top < len)
+      continue;
+    a = top - len;
+    if(a < PGROUNDUP(p->sz) || a <= best)
+      continue;
+    for(w = p->vma; w < &p->vma[NVMA]; w++)
+      if(w->len && a < w->addr + w->len && w->addr < top)
+        break;
+    if(w == &p->vma[NVMA])
+      best = a;
+  }
+  return best;
+}
+
+// Handle a page fault at va above the heap: read the page
+// in from its mapped file, or make a clean MAP_SHARED page
+// writable on its first write.
+// Returns 0 on success, -1 if va isn't mapped, the access
+// isn't allowed, or there is no memory.
+int
+mmapfault(uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  struct inode *ip;
+  pte_t *pte;
+  char *mem;
+  int perm, locked, r;
+
+  if((v = vmafind(p, va)) == 0)
+    return -1;
+  if(write && (v->prot & PROT_WRITE) == 0)
+    return -1;
+  va = PGROUNDDOWN(va);
+
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(!write || v->flags != MAP_SHARED || (*pte & PTE_W))
+      return -1;
+    *pte |= PTE_W;  // now dirty
+    return 0;
+  }
+
+  perm = PTE_R|PTE_U;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  if((v->prot & PROT_WRITE) && (v->flags == MAP_PRIVATE || write))
+    perm |= PTE_W;
+
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  ip = v->f->ip;
+  // a read() of this file into the mapping holds ip->lock.
+  locked = holdingsleep(&ip->lock);
+  if(!locked)
+    ilock(ip);
+  r = readi(ip, 0, (uint64)mem, v->off + (va - v->addr), PGSIZE);
+  if(!locked)
+    iunlock(ip);
+  if(r < 0 || mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Write the dirty pages of v in [addr, addr+len) back to
+// its file, if it is a writable shared mapping, and mark
+// them clean. The file is never extended.
+static void
+vmasync(struct proc *p, struct vma *v, uint64 addr, uint64 len)
+{
+  struct inode *ip = v->f->ip;
+  uint64 a;
+  uint off, n;
+  pte_t *pte;
+
+  if(v->flags != MAP_SHARED || (v->prot & PROT_WRITE) == 0)
+    return;
+  for(a = addr; a < addr + len; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_W) == 0)
+      continue;
+    off = v->off + (a - v->addr);
+    begin_op();
+    ilock(ip);
+    if(off < ip->size){
+      n = ip->size - off;
+      if(n > PGSIZE)
+        n = PGSIZE;
+      writei(ip, 0, PTE2PA(*pte), off, n);
+    }
+    iunlock(ip);
+    end_op();
+    *pte &= ~PTE_W;
+    vminval();
+  }
+}
+
+// Unmap [addr, addr+len) of v, which is at its start or end.
+static void
+vmaunmap(struct proc *p, struct vma *v, uint64 addr, uint64 len)
+{
+  vmasync(p, v, addr, len);
+  uvmunmap(p->pagetable, addr, len / PGSIZE, 1);
+  if(addr == v->addr){
+    v->addr += len;
+    v->off += len;
+  }
+  v->len -= len;
+  if(v->len == 0){
+    fileclose(v->f);
+    v->f = 0;
+  }
+}
+
+// Write back p's shared mappings, before fork().
+void
+mmapsync(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len)
+      vmasync(p, v, v->addr, v->len);
+}
+
+// Give child np copies of p's mappings. Private pages are
+// shared copy-on-write; shared mappings start out empty.
+// Returns 0 on success, -1 (having undone everything) if
+// there is no memory.
+int
+mmapfork(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->len == 0)
+      continue;
+    if(v->flags == MAP_PRIVATE &&
+       uvmcopy(p->pagetable, np->pagetable, v->addr, v->addr + v->len) < 0)
+      goto bad;
+    np->vma[i] = *v;
+  }
+  for(v = np->vma; v < &np->vma[NVMA]; v++)
+    if(v->len)
+      filedup(v->f);
+  return 0;
+
+ bad:
+  while(--i >= 0){
+    v = &np->vma[i];
+    if(v->len)
+      uvmunmap(np->pagetable, v->addr, v->len / PGSIZE, 1);
+    v->len = 0;
+  }
+  return -1;
+}
+
+// Unmap all of p's mappings, for exit() and exec().
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len)
+      vmaunmap(p, v, v->addr, v->len);
+}
+
+// void *mmap(void *addr, int len, int prot, int flags, int fd, int off)
+// addr is only a hint, and is ignored.
+uint64
+sys_mmap(void)
+{
+  struct proc *p = myproc();
+  struct file *f;
+  struct vma *v, *fv;
+  uint64 addr, len;
+  int n, prot, flags, off;
+
+  if(argint(1, &n) < 0 || argint(2, &prot) < 0 || argint(3, &flags) < 0 ||
+     argfd(4, 0, &f) < 0 || argint(5, &off) < 0)
+    return -1;
+  if(n <= 0 || off < 0 || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+
+  fv = 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0){
+      fv = v;
+      break;
+    }
+  }
+  len = PGROUNDUP((uint64)n);
+  if(fv == 0 || (addr = vmaplace(p, len)) == 0)
+    return -1;
+
+  fv->addr = addr;
+  fv->len = len;
+  fv->prot = prot;
+  fv->flags = flags;
+  fv->f = filedup(f);
+  fv->off = off;
+  return addr;
+}
+
+// int munmap(void *addr, int len)
+// Unmaps whole pages at the start or end of a mapping,
+// or all of it; a hole in the middle isn't supported.
+uint64
+sys_munmap(void)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 addr, len;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  if(addr % PGSIZE != 0 || n <= 0)
+    return -1;
+  len = PGROUNDUP((uint64)n);
+  if((v = vmafind(p, addr)) == 0 || addr + len > v->addr + v->len)
+    return -1;
+  if(addr != v->addr && addr + len != v->addr + v->len)
+    return -1;
+  vmaunmap(p, v, addr, len);
+  return 0;
+}
@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "stat.h"
 
 uint64
 sys_exit(void)
@@ -41,7 +42,7 @@ sys_wait(void)
 uint64
 sys_sbrk(void)
 {
-  int addr;
+  uint64 addr;
   int n;
 
   if(argint(0, &n) < 0)
@@ -95,3 +96,18 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// Report page allocator statistics.
+uint64
+sys_kmemstat(void)
+{
+  struct kmemstat st;
+  uint64 addr; // user pointer to struct kmemstat
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  kmemstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
@@ -3,7 +3,7 @@
 // uses qemu's mmio interface to virtio.
 // qemu presents a "legacy" virtio interface.
 //
-// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0,num-queues=3
 //
 
 #include "types.h"
@@ -20,12 +20,14 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk {
+// one virtqueue. the device has one per CPU, if it allows,
+// so that CPUs don't contend for them.
+struct vqueue {
   // the virtio driver and device mostly communicate through a set of
-  // structures in RAM. pages[] allocates that memory. pages[] is a
-  // global (instead of calls to kalloc()) because it must consist of
-  // two contiguous pages of page-aligned physical memory.
-  char pages[2*PGSIZE];
+  // structures in RAM. pages[] holds that memory. it must consist of
+  // two contiguous pages of page-aligned physical memory, so it is
+  // allocated with kalloc_order().
+  char *pages;
 
   // pages[] is divided into three regions (descriptors, avail, and
   // used), as explained in Section 2.6 of the virtio specification
@@ -35,8 +37,9 @@ static struct disk {
   // the first region of pages[] is a set (not a ring) of DMA
   // descriptors, with which the driver tells the device where to read
   // and write individual disk operations. there are NUM descriptors.
-  // most commands consist of a "chain" (a linked list) of a couple of
-  // these descriptors.
+  // a command is either a single descriptor pointing to an
+  // indirect table of descriptors (see ind[] below), or, if the
+  // device can't do that, a "chain" (a linked list) of them.
   // points into pages[].
   struct virtq_desc *desc;
 
@@ -61,25 +64,63 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b[MAXIOBLOCKS]; // consecutive blocks
+    int n;
     char status;
   } info[NUM];
 
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
+
+  // indirect descriptor tables, one-for-one with descriptors.
+  // the spec requires 16-byte alignment.
+  struct virtq_desc ind[NUM][MAXIOBLOCKS+2] __attribute__ ((aligned (16)));
   
-  struct spinlock vdisk_lock;
-  
-} __attribute__ ((aligned (PGSIZE))) disk;
+  struct spinlock lock;
+};
+
+static struct disk {
+  int nq;             // number of queues in use
+  int indirect;       // device accepts indirect descriptors?
+  struct vqueue q[NVQUEUE];
+} disk;
+
+static void
+vq_init(struct vqueue *q, int qi)
+{
+  initlock(&q->lock, "virtio_disk");
+
+  *R(VIRTIO_MMIO_QUEUE_SEL) = qi;
+  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if(max == 0)
+    panic("virtio disk has no queue");
+  if(max < NUM)
+    panic("virtio disk max queue too short");
+  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  if((q->pages = kalloc_order(1)) == 0)
+    panic("virtio disk kalloc");
+  memset(q->pages, 0, 2*PGSIZE);
+  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)q->pages) >> PGSHIFT;
+
+  // desc = pages -- num * virtq_desc
+  // avail = pages + num * virtq_desc -- 2 * uint16, then num * uint16
+  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
+
+  q->desc = (struct virtq_desc *) q->pages;
+  q->avail = (struct virtq_avail *)(q->pages + NUM*sizeof(struct virtq_desc));
+  q->used = (struct virtq_used *) (q->pages + PGSIZE);
+
+  // all NUM descriptors start out unused.
+  for(int i = 0; i < NUM; i++)
+    q->free[i] = 1;
+}
 
 void
 virtio_disk_init(void)
 {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
-
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(VIRTIO_MMIO_VERSION) != 1 ||
      *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
@@ -98,55 +139,43 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
   *R(VIRTIO_MMIO_STATUS) = status;
 
-  // tell device we're completely ready.
-  status |= VIRTIO_CONFIG_S_DRIVER_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  disk.indirect = (features & (1 << VIRTIO_RING_F_INDIRECT_DESC)) != 0;
+  disk.nq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ)){
+    disk.nq = *(volatile uint16 *)R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_NUM_QUEUES);
+    if(disk.nq > NVQUEUE)
+      disk.nq = NVQUEUE;
+    if(disk.nq < 1)
+      disk.nq = 1;
+  }
 
   *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
-  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
-
-  // desc = pages -- num * virtq_desc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
-
-  disk.desc = (struct virtq_desc *) disk.pages;
-  disk.avail = (struct virtq_avail *)(disk.pages + NUM*sizeof(struct virtq_desc));
-  disk.used = (struct virtq_used *) (disk.pages + PGSIZE);
+  for(int i = 0; i < disk.nq; i++)
+    vq_init(&disk.q[i], i);
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  // tell device we're completely ready.
+  status |= VIRTIO_CONFIG_S_DRIVER_OK;
+  *R(VIRTIO_MMIO_STATUS) = status;
 
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct vqueue *q)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(q->free[i]){
+      q->free[i] = 0;
       return i;
     }
   }
@@ -155,28 +184,27 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct vqueue *q, int i)
 {
   if(i >= NUM)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(q->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  q->desc[i].addr = 0;
+  q->desc[i].len = 0;
+  q->desc[i].flags = 0;
+  q->desc[i].next = 0;
+  q->free[i] = 1;
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct vqueue *q, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = q->desc[i].flags;
+    int nxt = q->desc[i].next;
+    free_desc(q, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -184,46 +212,67 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(struct vqueue *q, int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+  for(int i = 0; i < n; i++){
+    idx[i] = alloc_desc(q);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(q, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// Start a disk operation on the n buffers in bs, which must
+// hold consecutive blocks of the disk, as a single request, and
+// don't wait for it to finish. If no descriptors are free,
+// return -1 having started nothing. virtio_disk_intr() tells
+// iosched_done() when the request finishes.
+int
+virtio_disk_submit(struct buf **bs, int n, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
-
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+  uint64 sector = bs[0]->blockno * (BSIZE / 512);
+  struct vqueue *q;
+  struct virtq_desc *d;
+  int i, qi, head;
+
+  if(n < 1 || n > MAXIOBLOCKS)
+    panic("virtio_disk_submit");
+  for(i = 1; i < n; i++)
+    if(bs[i]->blockno != bs[0]->blockno + i)
+      panic("virtio_disk_submit: not consecutive");
+
+  // use this CPU's queue.
+  push_off();
+  qi = cpuid() % disk.nq;
+  pop_off();
+  q = &disk.q[qi];
+
+  acquire(&q->lock);
+
+  // the spec's Section 5.2 says that legacy block operations
+  // use a descriptor for type/reserved/sector, then descriptors
+  // for the data (one per buffer, here), then one for a 1-byte
+  // status result. with indirect descriptors, they go in a
+  // table that a single descriptor in the queue points to.
+
+  // allocate the descriptors.
+  int idx[MAXIOBLOCKS+2];
+  int nd = disk.indirect ? 1 : n+2;
+  if(alloc_descs(q, idx, nd) < 0){
+    release(&q->lock);
+    return -1;
   }
+  head = idx[0];
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &q->ops[head];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -232,58 +281,95 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  if(disk.indirect){
+    d = q->ind[head];
+    q->desc[head].addr = (uint64) d;
+    q->desc[head].len = (n+2)*sizeof(struct virtq_desc);
+    q->desc[head].flags = VRING_DESC_F_INDIRECT;
+    q->desc[head].next = 0;
+    // chain through the table.
+    for(i = 0; i < n+2; i++)
+      idx[i] = i;
+  } else {
+    d = q->desc;
+  }
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  d[idx[0]].addr = (uint64) buf0;
+  d[idx[0]].len = sizeof(struct virtio_blk_req);
+  d[idx[0]].flags = VRING_DESC_F_NEXT;
+  d[idx[0]].next = idx[1];
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  for(i = 0; i < n; i++){
+    d[idx[1+i]].addr = (uint64) bs[i]->data;
+    d[idx[1+i]].len = BSIZE;
+    if(write)
+      d[idx[1+i]].flags = 0; // device reads b->data
+    else
+      d[idx[1+i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    d[idx[1+i]].flags |= VRING_DESC_F_NEXT;
+    d[idx[1+i]].next = idx[2+i];
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  q->info[head].status = 0xff; // device writes 0 on success
+  d[idx[n+1]].addr = (uint64) &q->info[head].status;
+  d[idx[n+1]].len = 1;
+  d[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  d[idx[n+1]].next = 0;
+
+  // record the bufs for virtio_disk_intr().
+  for(i = 0; i < n; i++)
+    q->info[head].b[i] = bs[i];
+  q->info[head].n = n;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  q->avail->ring[q->avail->idx % NUM] = head;
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  q->avail->idx += 1; // not % NUM ...
 
   __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = qi; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
-  }
+  release(&q->lock);
+  return 0;
+}
+
+// finish the operations the device has placed in q's used ring,
+// and return how many there were.
+static int
+vq_intr(struct vqueue *q, int polled)
+{
+  int n = 0;
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  acquire(&q->lock);
 
-  release(&disk.vdisk_lock);
+  // the device increments q->used->idx when it
+  // adds an entry to the used ring.
+
+  while(q->used_idx != q->used->idx){
+    __sync_synchronize();
+    int id = q->used->ring[q->used_idx % NUM].id;
+
+    if(q->info[id].status != 0)
+      panic("virtio_disk_intr status");
+
+    free_chain(q, id);
+    iosched_done(q->info[id].b, q->info[id].n, polled);
+
+    q->used_idx += 1;
+    n++;
+  }
+
+  release(&q->lock);
+  return n;
 }
 
 void
 virtio_disk_intr()
 {
-  acquire(&disk.vdisk_lock);
-
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
@@ -294,22 +380,38 @@ virtio_disk_intr()
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
+  // all queues share the one interrupt.
+  for(int i = 0; i < disk.nq; i++)
+    vq_intr(&disk.q[i], 0);
 
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+  // the finished requests made room for more.
+  iosched_run();
+}
 
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
+// Finish any requests the device has completed, without
+// waiting for its interrupt. Returns the number finished.
+int
+virtio_disk_poll(void)
+{
+  int n = 0;
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+  for(int i = 0; i < disk.nq; i++)
+    n += vq_intr(&disk.q[i], 1);
+  if(n > 0)
+    iosched_run();
+  return n;
+}
 
-    disk.used_idx += 1;
+// Ask the device to interrupt on completions (on != 0), or not
+// to bother because someone is polling. The device may
+// interrupt anyway.
+void
+virtio_disk_intrs(int on)
+{
+  for(int i = 0; i < disk.nq; i++){
+    struct vqueue *q = &disk.q[i];
+    acquire(&q->lock);
+    q->avail->flags = on ? 0 : VRING_AVAIL_F_NO_INTERRUPT;
+    release(&q->lock);
   }
-
-  release(&disk.vdisk_lock);
 }
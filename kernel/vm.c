@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -15,14 +17,31 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+// kalloc_order() order of a superpage.
+#define SUPERPGORDER 9
+
+static pte_t *walklevel(pagetable_t, uint64, int, int);
+
+// bumped whenever a user mapping is removed or loses
+// permissions, invalidating every process's cached
+// translation for copyin() and copyout() (see uvmxlate()).
+uint64 vmgen;
+
+// Note that some user mapping has been removed or made
+// less permissive.
+void
+vminval(void)
+{
+  __sync_fetch_and_add(&vmgen, 1);
+}
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -36,8 +55,13 @@ kvmmake(void)
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
-  // map kernel data and the physical RAM we'll make use of.
-  kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
+  // map kernel data and the physical RAM we'll make use of,
+  // with 4096-byte pages up to the first superpage boundary
+  // and 2 MB superpages from there on.
+  uint64 super = SUPERPGROUNDUP((uint64)etext);
+  if(super > (uint64)etext)
+    kvmmap(kpgtbl, (uint64)etext, (uint64)etext, super-(uint64)etext, PTE_R | PTE_W);
+  kvmmap(kpgtbl, super, super, PHYSTOP-super, PTE_R | PTE_W | PTE_S);
 
   // map the trampoline for trap entry/exit to
   // the highest virtual address in the kernel.
@@ -77,24 +101,76 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// If va lies in a 2 MB superpage, returns the superpage's
+// level-1 PTE, which has PTE_S set.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, alloc, 0);
+}
+
+// Like walk(), but return the PTE at the given level:
+// 0 for a 4096-byte page, 1 for a superpage.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int leaf)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
+  for(int level = 2; level > leaf; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(*pte & PTE_S)
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(leaf, va)];
+}
+
+// Physical address of the page at va, given the PTE
+// that walk() returned for it.
+static uint64
+ptepa(pte_t pte, uint64 va)
+{
+  uint64 pa = PTE2PA(pte);
+
+  if(pte & PTE_S)
+    pa += PGROUNDDOWN(va) & (SUPERPGSIZE - 1);
+  return pa;
+}
+
+// Split the superpage whose level-1 PTE is *pte into 512
+// ordinary PTEs with the same permissions. If drop >= 0, the
+// superpage's page number drop is being unmapped and freed,
+// so it becomes the new page-table page instead of allocating
+// one, and that can't fail.
+// Returns 0 on success, -1 if out of memory.
+static int
+demote(pte_t *pte, int drop)
+{
+  pagetable_t pt;
+  uint64 pa;
+  int i, flags;
+
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte) & ~PTE_S;
+  if(drop >= 0){
+    pt = (pagetable_t)(pa + (uint64)drop * PGSIZE);
+    memset(pt, 0, PGSIZE);
+  } else if((pt = (pagetable_t)kalloc_zeroed()) == 0){
+    return -1;
+  }
+  for(i = 0; i < 512; i++)
+    if(i != drop)
+      pt[i] = PA2PTE(pa + (uint64)i * PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
 }
 
 // Look up a virtual address, return the physical address,
@@ -116,7 +192,7 @@ walkaddr(pagetable_t pagetable, uint64 va)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = ptepa(*pte, va);
   return pa;
 }
 
@@ -132,52 +208,82 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. If perm includes PTE_S, creates 2 MB
+// superpages, and va, pa and size must be superpage-aligned.
+// Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, pgsize;
   pte_t *pte;
+  int leaf;
 
   if(size == 0)
     panic("mappages: size");
+
+  pgsize = PGSIZE;
+  leaf = 0;
+  if(perm & PTE_S){
+    if(va % SUPERPGSIZE || pa % SUPERPGSIZE || size % SUPERPGSIZE)
+      panic("mappages: superpage alignment");
+    pgsize = SUPERPGSIZE;
+    leaf = 1;
+  }
   
-  a = PGROUNDDOWN(va);
-  last = PGROUNDDOWN(va + size - 1);
+  a = va & ~(pgsize - 1);
+  last = (va + size - 1) & ~(pgsize - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    if((pte = walklevel(pagetable, a, 1, leaf)) == 0)
       return -1;
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
     if(a == last)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += pgsize;
+    pa += pgsize;
   }
   return 0;
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never touched, and so
+// were never allocated (see vmfault()), are skipped.
+// A superpage that is only partly in the range is split.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end;
   pte_t *pte;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+  vminval();
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(*pte & PTE_S){
+      if(a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= end){
+        if(do_free)
+          kfree_order((void*)PTE2PA(*pte), SUPERPGORDER);
+        *pte = 0;
+        a += SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      if(demote(pte, do_free ? (a % SUPERPGSIZE) / PGSIZE : -1) < 0)
+        panic("uvmunmap: demote");
+      if(do_free)
+        continue;  // page a is now a page-table page
+      pte = walk(pagetable, a, 0);
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
@@ -192,10 +298,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -209,8 +314,7 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -228,12 +332,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -291,42 +394,271 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
+// Count the leaf mappings in pagetable: 4096-byte pages
+// in *npage and 2 MB superpages in *nsuper. Each mapping
+// a program touches needs a TLB entry of its own.
+void
+vmcount(pagetable_t pagetable, int *npage, int *nsuper)
+{
+  for(int i = 0; i < 512; i++){
+    pte_t pte = pagetable[i];
+    if((pte & PTE_V) == 0)
+      continue;
+    if((pte & (PTE_R|PTE_W|PTE_X)) == 0)
+      vmcount((pagetable_t)PTE2PA(pte), npage, nsuper);
+    else if(pte & PTE_S)
+      (*nsuper)++;
+    else
+      (*npage)++;
+  }
+}
+
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies the page table, but shares the physical
+// memory: writable pages become read-only copy-on-write
+// pages in both page tables, to be copied by cowfault()
+// when either process first writes them.
 // returns 0 on success, -1 on failure.
+// copies the range [start, end), which must be page-aligned.
 // frees any allocated pages on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 start, uint64 end)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
+  vminval();  // pages of old are about to lose PTE_W
+  for(i = start; i < end; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+      continue;  // not yet allocated
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(*pte & PTE_S){
+      // share superpages as copy-on-write 4096-byte pages.
+      if(demote(pte, -1) < 0)
+        goto err;
+      pte = walk(old, i, 0);
+    }
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    krefinc((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Handle a write to copy-on-write page va: give the page
+// table a private, writable copy of the page, or if no other
+// page table shares it, just make it writable.
+// Returns 0 on success, -1 if va isn't a copy-on-write page
+// or there is no memory for the copy.
+static int
+cowfault(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  vminval();
+  kfree((void*)pa);
+  return 0;
+}
+
+// Map a whole zeroed superpage for the 2 MB region around heap
+// address va, if all of the region is in the heap and nothing
+// in it is mapped yet. Returns 0 on success, -1 if the region
+// isn't eligible or no 2 MB block of memory is free.
+static int
+superfault(struct proc *p, uint64 va)
+{
+  uint64 base = SUPERPGROUNDDOWN(va);
+  struct seg *s;
+  pte_t *pte;
+  char *mem;
+
+  if(base + SUPERPGSIZE > p->sz)
+    return -1;
+  for(s = p->seg; s < &p->seg[p->nseg]; s++)
+    if(base < s->va + s->filesz && s->va < base + SUPERPGSIZE)
+      return -1;
+  pte = walklevel(p->pagetable, base, 0, 1);
+  if(pte && (*pte & PTE_V))
+    return -1;
+
+  // worth having only if one is free: fall back to small
+  // pages rather than empty the caches for it.
+  if((mem = kalloc_order_try(SUPERPGORDER)) == 0)
+    return -1;
+  memset(mem, 0, SUPERPGSIZE);
+  if(mappages(p->pagetable, base, SUPERPGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U|PTE_S) != 0){
+    kfree_order(mem, SUPERPGORDER);
+    return -1;
+  }
+  return 0;
+}
+
+// Handle a page fault at user virtual address va in pagetable,
+// from a user instruction or from copyin()/copyout().
+// sbrk() only grows p->sz, so the first touch of a heap page
+// lands here, and gets a newly allocated zeroed page;
+// exec() maps nothing of the program file, so its pages are
+// read in by execfault().
+// A write to a copy-on-write page gets a private copy.
+// Addresses above p->sz belong to mmap() (see mmapfault()).
+// Returns 0 if the fault was handled, -1 if va is not part
+// of the address space or there is no memory.
+int
+vmfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct seg *s;
+  pte_t *pte;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V) && write && (*pte & PTE_COW))
+    return cowfault(pagetable, va);
+
+  if(p == 0 || pagetable != p->pagetable)
+    return -1;
+
+  // above the heap: a file mapped by mmap()?
+  if(va >= p->sz)
+    return mmapfault(va, write);
+
+  if(pte && (*pte & PTE_V))
+    return -1;
+
+  // part of the program file?
+  for(s = p->seg; s < &p->seg[p->nseg]; s++)
+    if(va >= s->va && va < s->va + s->filesz)
+      return execfault(s, va);
+
+  // lazily allocated heap page.
+  if(superfault(p, va) == 0)
+    return 0;
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if(mappages(pagetable, PGROUNDDOWN(va), PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Load any pages of [va, va+len) in the current process that
+// still have to be read from the program file or a mapped
+// file, for system calls
+// that copy to or from user memory while holding a spinlock or
+// a buffer's sleeplock, where execfault() could not safely sleep.
+// Errors are left for the copy itself to report.
+void
+uvmprefault(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct seg *s;
+  uint64 a;
+  pte_t *pte;
+
+  for(a = PGROUNDDOWN(va); a < va + len && a < TRAPFRAME; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte && (*pte & PTE_V))
+      continue;
+    if(a >= p->sz){
+      if(mmapfault(a, 0) < 0)
+        break;
+      continue;
+    }
+    for(s = p->seg; s < &p->seg[p->nseg]; s++){
+      if(a >= s->va && a < s->va + s->filesz){
+        execfault(s, a);
+        break;
+      }
+    }
+  }
+}
+
+// Translate user address va for copyin() or copyout(), faulting
+// its page in if it is not yet allocated or, when write is set,
+// if it is not yet writable (copy-on-write, or a clean shared
+// mapping). Returns the physical address and sets *n to the
+// number of bytes from va to the end of its page or superpage,
+// which are physically contiguous; or returns 0 if va is not
+// accessible.
+// The current process remembers the last page it translated,
+// so that a run of small copies to the same page, such as
+// piperead()'s, doesn't walk the page table each time.
+static uint64
+uvmxlate(pagetable_t pagetable, uint64 va, int write, uint64 *n)
+{
+  struct proc *p = myproc();
+  uint64 gen, size, base;
+  pte_t *pte;
+
+  gen = __atomic_load_n(&vmgen, __ATOMIC_SEQ_CST);
+  if(p && pagetable == p->pagetable && p->xgen == gen &&
+     va - p->xva < p->xsize && (!write || p->xwrite)){
+    *n = p->xsize - (va - p->xva);
+    return p->xpa + (va - p->xva);
+  }
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_W) == 0)){
+    if(vmfault(pagetable, va, write) < 0)
+      return 0;
+    gen = __atomic_load_n(&vmgen, __ATOMIC_SEQ_CST);
+    pte = walk(pagetable, va, 0);
+  }
+  if((*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+    return 0;
+  if(write && (*pte & PTE_W) == 0)
+    return 0;
+
+  size = (*pte & PTE_S) ? SUPERPGSIZE : PGSIZE;
+  base = va & ~(size - 1);
+  if(p && pagetable == p->pagetable){
+    p->xva = base;
+    p->xpa = PTE2PA(*pte);
+    p->xsize = size;
+    p->xwrite = (*pte & PTE_W) != 0;
+    p->xgen = gen;
+  }
+  *n = size - (va - base);
+  return PTE2PA(*pte) + (va - base);
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -338,6 +670,7 @@ uvmclear(pagetable_t pagetable, uint64 va)
   if(pte == 0)
     panic("uvmclear");
   *pte &= ~PTE_U;
+  vminval();
 }
 
 // Copy from kernel to user.
@@ -346,21 +679,18 @@ uvmclear(pagetable_t pagetable, uint64 va)
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
-  uint64 n, va0, pa0;
+  uint64 n, pa;
 
   while(len > 0){
-    va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa = uvmxlate(pagetable, dstva, 1, &n)) == 0)
       return -1;
-    n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
-    memmove((void *)(pa0 + (dstva - va0)), src, n);
+    memmove((void *)pa, src, n);
 
     len -= n;
     src += n;
-    dstva = va0 + PGSIZE;
+    dstva += n;
   }
   return 0;
 }
@@ -371,25 +701,25 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
-  uint64 n, va0, pa0;
+  uint64 n, pa;
 
   while(len > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa = uvmxlate(pagetable, srcva, 0, &n)) == 0)
       return -1;
-    n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
-    memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    memmove(dst, (void *)pa, n);
 
     len -= n;
     dst += n;
-    srcva = va0 + PGSIZE;
+    srcva += n;
   }
   return 0;
 }
 
+// true if some byte of the 64-bit word x is zero.
+#define HASZERO(x) (((x) - 0x0101010101010101UL) & ~(x) & 0x8080808080808080UL)
+
 // Copy a null-terminated string from user to kernel.
 // Copy bytes to dst from virtual address srcva in a given page table,
 // until a '\0', or max.
@@ -397,38 +727,38 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
-  int got_null = 0;
+  uint64 i, n, w;
+  char *p;
 
-  while(got_null == 0 && max > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+  while(max > 0){
+    if((p = (char*)uvmxlate(pagetable, srcva, 0, &n)) == 0)
       return -1;
-    n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
 
-    char *p = (char *) (pa0 + (srcva - va0));
-    while(n > 0){
-      if(*p == '\0'){
-        *dst = '\0';
-        got_null = 1;
-        break;
-      } else {
-        *dst = *p;
+    for(i = 0; i < n; i++){
+      // a word at a time while p is aligned and
+      // the word holds no '\0'.
+      if(((uint64)(p + i) & 7) == 0){
+        for(; i + 8 <= n; i += 8){
+          w = *(uint64*)(p + i);
+          if(HASZERO(w))
+            break;
+          if(((uint64)(dst + i) & 7) == 0)
+            *(uint64*)(dst + i) = w;
+          else
+            memmove(dst + i, &w, 8);
+        }
+        if(i == n)
+          break;
       }
-      --n;
-      --max;
-      p++;
-      dst++;
+      if((dst[i] = p[i]) == '\0')
+        return 0;
     }
 
-    srcva = va0 + PGSIZE;
-  }
-  if(got_null){
-    return 0;
-  } else {
-    return -1;
+    max -= n;
+    dst += n;
+    srcva += n;
   }
+  return -1;
 }
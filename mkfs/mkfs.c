@@ -22,7 +22,7 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog;     // Number of log blocks, set in main()
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -89,6 +89,13 @@ main(int argc, char *argv[])
   if(fsfd < 0)
     die(argv[1]);
 
+  // the log gets a tenth of the disk, but must hold at least
+  // its header and two transactions of MAXOPBLOCKS blocks,
+  // each with its descriptor.
+  nlog = FSSIZE / 10;
+  if(nlog < 2*(MAXOPBLOCKS+1) + 1)
+    nlog = 2*(MAXOPBLOCKS+1) + 1;
+
   // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
@@ -253,33 +260,50 @@ void
 iappend(uint inum, void *xp, int n)
 {
   char *p = (char*)xp;
-  uint fbn, off, n1;
+  uint fbn, off, n1, bn;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
+  struct extent xext[NXEXTENT], *e, *last;
   uint x;
+  int i;
 
   rinode(inum, &din);
+  if(xint(din.xblock))
+    rsect(xint(din.xblock), (char*)xext);
+  else
+    memset(xext, 0, sizeof(xext));
   off = xint(din.size);
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
+    // find the extent holding fbn.
+    x = 0;
+    bn = fbn;
+    e = last = 0;
+    for(i = 0; i < NEXTENT + NXEXTENT; i++){
+      e = i < NEXTENT ? &din.ext[i] : &xext[i - NEXTENT];
+      if(xint(e->len) == 0)
+        break;
+      if(bn < xint(e->len)){
+        x = xint(e->start) + bn;
+        break;
       }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      bn -= xint(e->len);
+      last = e;
+    }
+    if(x == 0){
+      // a new block: extend the last extent, or start another.
+      x = freeblock++;
+      if(last && xint(last->start) + xint(last->len) == x){
+        last->len = xint(xint(last->len) + 1);
+      } else {
+        assert(i < NEXTENT + NXEXTENT);
+        if(i >= NEXTENT && xint(din.xblock) == 0)
+          din.xblock = xint(freeblock++);
+        e->start = xint(x);
+        e->len = xint(1);
       }
-      x = xint(indirect[fbn-NDIRECT]);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
@@ -289,6 +313,8 @@ iappend(uint inum, void *xp, int n)
     off += n1;
     p += n1;
   }
+  if(xint(din.xblock))
+    wsect(xint(din.xblock), (char*)xext);
   din.size = xint(off);
   winode(inum, &din);
 }
@@ -0,0 +1,70 @@
+// Print block I/O and log statistics, and the page allocator's.
+// iostat -p turns on polling for disk completions first;
+// iostat -i turns it off.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct bstat st;
+  struct diskstat ds;
+  struct logstat ls;
+  struct kmemstat ks;
+  int i;
+
+  if(argc > 1){
+    if(strcmp(argv[1], "-p") == 0)
+      diskpoll(1);
+    else if(strcmp(argv[1], "-i") == 0)
+      diskpoll(0);
+    else {
+      fprintf(2, "usage: iostat [-p | -i]\n");
+      exit(1);
+    }
+  }
+
+  if(bstat(&st) < 0){
+    fprintf(2, "iostat: bstat failed\n");
+    exit(1);
+  }
+  printf("buffer cache: %d buffers, %d on A1in, %d on Am\n",
+         st.nbuf, st.nin, st.nbuf - st.nin);
+  printf("  hits %l misses %l (ghost hits %l) evictions %l\n",
+         st.hits, st.misses, st.ghosthits, st.evictions);
+
+  if(diskstat(&ds) < 0){
+    fprintf(2, "iostat: diskstat failed\n");
+    exit(1);
+  }
+  printf("disk: %l blocks in %l requests, %d queued, %d in flight\n",
+         ds.nbuf, ds.nreq, ds.queued, ds.inflight);
+  if(ds.nbuf > 0)
+    printf("  latency avg %l us, max %l us\n", ds.totlat / ds.nbuf, ds.maxlat);
+  printf("  completions: %l by interrupt", ds.nintr);
+  if(ds.nintr > 0)
+    printf(" (avg %l us)", ds.intrlat / ds.nintr);
+  printf(", %l by polling", ds.npolled);
+  if(ds.npolled > 0)
+    printf(" (avg %l us)", ds.polllat / ds.npolled);
+  printf("; polling %s\n", ds.poll ? "on" : "off");
+
+  if(logstat(&ls) < 0){
+    fprintf(2, "iostat: logstat failed\n");
+    exit(1);
+  }
+  printf("log: %l commits, %l checkpoints writing %l blocks home, %d pending\n",
+         ls.ncommit, ls.nckpt, ls.nhome, ls.nck);
+
+  if(kmemstat(&ks) < 0){
+    fprintf(2, "iostat: kmemstat failed\n");
+    exit(1);
+  }
+  printf("memory: %d free pages\n", ks.nfree);
+  for(i = 0; i < ks.ncpu; i++)
+    printf("  cpu %d: %d cached, lock taken %l times, %l contended\n",
+           i, ks.cpu[i].nfree, ks.cpu[i].nlock, ks.cpu[i].nbusy);
+  exit(0);
+}
@@ -1,4 +1,8 @@
 struct stat;
+struct bstat;
+struct diskstat;
+struct kmemstat;
+struct logstat;
 struct rtcdate;
 
 // system calls
@@ -23,6 +27,14 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int bstat(struct bstat*);
+int diskstat(struct diskstat*);
+int diskpoll(int);
+int fsync(int);
+int kmemstat(struct kmemstat*);
+int logstat(struct logstat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
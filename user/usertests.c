@@ -724,6 +724,244 @@ exectest(char *s)
 
 }
 
+// read() the program's own file into initialized data that
+// has not been loaded from that file yet, so that the kernel
+// must page in from a file it is in the middle of reading.
+char selfbuf[3*4096] = { 1 };
+
+void
+readself(char *s)
+{
+  int fd;
+
+  fd = open("usertests", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open usertests failed\n", s);
+    exit(1);
+  }
+  if(read(fd, selfbuf + 4096, 4096) != 4096){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(selfbuf[4096] != 0x7f || selfbuf[4097] != 'E'){
+    printf("%s: wrong data\n", s);
+    exit(1);
+  }
+}
+
+// fsync() waits for the log flusher to commit a write.
+void
+fsynctest(char *s)
+{
+  int fd;
+
+  fd = open("fsync.tmp", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  if(write(fd, "x", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(fsync(fd) != 0){
+    printf("%s: fsync failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(fsync(fd) != -1){
+    printf("%s: fsync of closed fd succeeded\n", s);
+    exit(1);
+  }
+  unlink("fsync.tmp");
+}
+
+// re-reading a small file should hit in the buffer cache,
+// and the disk should have carried at least one block per request.
+void
+bstattest(char *s)
+{
+  struct bstat st0, st1;
+  struct diskstat ds;
+  char buf[512];
+  int fd, i;
+
+  fd = open("bstat.tmp", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'b', sizeof(buf));
+  if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(bstat(&st0) < 0){
+    printf("%s: bstat failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2; i++){
+    fd = open("bstat.tmp", O_RDONLY);
+    if(fd < 0 || read(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    close(fd);
+  }
+  bstat(&st1);
+  unlink("bstat.tmp");
+  if(st1.hits <= st0.hits || st1.nin > st1.nbuf){
+    printf("%s: bad stats\n", s);
+    exit(1);
+  }
+  if(diskstat(&ds) < 0 || ds.nreq == 0 || ds.nbuf < ds.nreq){
+    printf("%s: bad disk stats\n", s);
+    exit(1);
+  }
+}
+
+// back-to-back small transactions should stay in the log,
+// rather than each being written home as soon as it commits.
+void
+logckpttest(char *s)
+{
+  struct logstat st0, st1;
+  int fd, i, n = 10;
+
+  fd = open("logckpt.tmp", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  if(write(fd, "x", 1) != 1 || fsync(fd) != 0){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(logstat(&st0) < 0){
+    printf("%s: logstat failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    // each changes the same data block and inode.
+    if(write(fd, "x", 1) != 1 || fsync(fd) != 0){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  logstat(&st1);
+  close(fd);
+  unlink("logckpt.tmp");
+  if(st1.ncommit - st0.ncommit < n){
+    printf("%s: %d commits for %d transactions\n", s,
+           (int)(st1.ncommit - st0.ncommit), n);
+    exit(1);
+  }
+  // at most one checkpoint, of what was in the log already
+  // and of the two blocks.
+  if(st1.nhome - st0.nhome > st0.nck + 2){
+    printf("%s: %d home writes for %d transactions\n", s,
+           (int)(st1.nhome - st0.nhome), n);
+    exit(1);
+  }
+}
+
+// mmap() a file: private writes stay private, shared writes
+// reach the file at munmap(), and a forked child sees the
+// parent's shared writes.
+void
+mmaptest(char *s)
+{
+  enum { SZ = 2*4096 + 100 };
+  char *p;
+  int fd, i, pid, xstatus;
+
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i += BUFSZ){
+    int n = SZ - i < BUFSZ ? SZ - i : BUFSZ;
+    for(int j = 0; j < n; j++)
+      buf[j] = 'a' + (i + j) % 23;
+    if(write(fd, buf, n) != n){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+
+  p = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++){
+    if(p[i] != 'a' + i % 23){
+      printf("%s: wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  // past the end of the file reads as zero.
+  if(p[SZ] != 0){
+    printf("%s: no zero fill\n", s);
+    exit(1);
+  }
+  p[0] = 'X';
+  if(munmap(p, SZ) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 'a'){
+    printf("%s: private write reached the file\n", s);
+    exit(1);
+  }
+  p[0] = 'Y';
+  p[SZ-1] = 'Z';
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(p[0] != 'Y' || p[SZ-1] != 'Z')
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child did not see shared writes\n", s);
+    exit(1);
+  }
+  // unmap the first page, then the rest.
+  if(munmap(p, 4096) < 0 || p[4096] != 'a' + 4096 % 23){
+    printf("%s: partial munmap failed\n", s);
+    exit(1);
+  }
+  if(munmap(p + 4096, SZ - 4096) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(fd < 0 || read(fd, buf, 1) != 1 || buf[0] != 'Y'){
+    printf("%s: shared write lost\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+}
+
 // simple fork and pipe read/write
 
 void
@@ -2080,6 +2318,154 @@ forktest(char *s)
   }
 }
 
+// does sbrk() allocate lazily? a reservation much larger than
+// physical memory should succeed, and reading or writing its
+// pages, from user code or from a system call, should work.
+void
+lazysbrk(char *s)
+{
+  enum { BIG=1024*1024*1024, STEP=64*1024*1024 };
+  char *a, *p;
+  int fd;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(BIG) failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += STEP){
+    if(*p != 0){
+      printf("%s: new page not zeroed\n", s);
+      exit(1);
+    }
+    *p = 'x';
+  }
+  for(p = a; p < a + BIG; p += STEP){
+    if(*p != 'x'){
+      printf("%s: lost a write\n", s);
+      exit(1);
+    }
+  }
+
+  // read() into a page that has never been touched.
+  fd = open("README", 0);
+  if(fd < 0){
+    printf("%s: open README failed\n", s);
+    exit(1);
+  }
+  if(read(fd, a + BIG - PGSIZE, 10) != 10){
+    printf("%s: read into untouched page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(sbrk(-BIG) != a + BIG){
+    printf("%s: sbrk(-BIG) failed\n", s);
+    exit(1);
+  }
+}
+
+// a large heap is mapped with superpages where it can be;
+// fork() and shrinking into the middle of one must split them.
+void
+superpg(char *s)
+{
+  enum { SZ = 6*1024*1024 };
+  char *a, *p;
+  int pid, xstatus, cut;
+
+  a = sbrk(SZ);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + SZ; p += 4096)
+    *p = (p - a) / 4096;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = a; p < a + SZ; p += 4096){
+      if(*p != (char)((p - a) / 4096))
+        exit(1);
+      *p = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong data\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + SZ; p += 4096){
+    if(*p != (char)((p - a) / 4096)){
+      printf("%s: child's write reached the parent\n", s);
+      exit(1);
+    }
+  }
+
+  cut = SZ/2 + 4096;
+  sbrk(-cut);
+  for(p = a; p < a + SZ - cut; p += 4096){
+    if(*p != (char)((p - a) / 4096)){
+      printf("%s: lost data after shrinking\n", s);
+      exit(1);
+    }
+  }
+  sbrk(cut);
+  for(p = a + SZ - cut; p < a + SZ; p += 4096){
+    if(*p != 0){
+      printf("%s: regrown memory not zeroed\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-SZ);
+}
+
+// does fork() share memory copy-on-write? a process using
+// two thirds of physical memory can only fork if it does.
+// are the child's writes invisible to the parent?
+void
+cowfork(char *s)
+{
+  uint64 sz = ((PHYSTOP - KERNBASE) / 3) * 2;
+  int pid, xstatus;
+  char *p, *q;
+
+  p = sbrk(sz);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(q = p; q < p + sz; q += PGSIZE)
+    *(int*)q = getpid();
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(q = p; q < p + sz; q += 64*PGSIZE)
+      *(int*)q = 0;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+
+  for(q = p; q < p + sz; q += PGSIZE){
+    if(*(int*)q != getpid()){
+      printf("%s: child's write is visible to parent\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-sz);
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2850,6 +3236,11 @@ main(int argc, char *argv[])
     {sharedfd, "sharedfd"},
     {dirtest, "dirtest"},
     {exectest, "exectest"},
+    {readself, "readself"},
+    {mmaptest, "mmaptest"},
+    {bstattest, "bstattest"},
+    {logckpttest, "logckpttest"},
+    {fsynctest, "fsynctest"},
     {bigargtest, "bigargtest"},
     {bigwrite, "bigwrite"},
     {bsstest, "bsstest"},
@@ -2880,6 +3271,9 @@ main(int argc, char *argv[])
     {dirfile, "dirfile"},
     {iref, "iref"},
     {forktest, "forktest"},
+    {cowfork, "cowfork"},
+    {lazysbrk, "lazysbrk"},
+    {superpg, "superpg"},
     {bigdir, "bigdir"}, // slow
     { 0, 0},
   };
@@ -36,3 +36,11 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("mmap");
+entry("munmap");
+entry("bstat");
+entry("diskstat");
+entry("diskpoll");
+entry("fsync");
+entry("kmemstat");
+entry("logstat");